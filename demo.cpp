@@ -183,6 +183,7 @@ struct DemoState : public dick::StateNode, std::enable_shared_from_this<dick::St
 int main()
 {
     dick::Platform platform { dick::DimScreen { SCREEN_W, SCREEN_H } };
+    platform.set_cursor_coalescing(true);
     dick::Resources global_resources;
 
     auto main_state = std::shared_ptr<dick::StateNode> { new DemoState { &global_resources } };
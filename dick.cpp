@@ -2,20 +2,52 @@
 // For the license (GPL2) details see the LICENSE file
 
 #include <cassert>
+#include <cmath>
+#include <cctype>
+#include <exception>
+#include <cstdio>
+#include <cstring>
 
 #include <map>
+#include <list>
+#include <deque>
+#include <atomic>
+#include <chrono>
+#include <mutex>
+#include <thread>
+#include <cstdint>
 #include <numeric>
+#include <tuple>
 #include <utility>
+#include <fstream>
+#include <sstream>
 #include <iostream>
 #include <algorithm>
+#include <unordered_map>
+#include <condition_variable>
 
 #include <allegro5/allegro_ttf.h>
 #include <allegro5/allegro_font.h>
 #include <allegro5/allegro_image.h>
 #include <allegro5/allegro_audio.h>
 #include <allegro5/allegro_acodec.h>
+#include <allegro5/allegro_memfile.h>
 #include <allegro5/allegro_primitives.h>
 
+#if defined(__unix__) || defined(__APPLE__)
+#   define DICK_MMAP 1
+#   include <fcntl.h>
+#   include <unistd.h>
+#   include <sys/mman.h>
+#   include <sys/stat.h>
+#endif
+
+#if defined(__linux__)
+#   define DICK_INOTIFY 1
+#   include <poll.h>
+#   include <sys/inotify.h>
+#endif
+
 #include "dick.h"
 
 namespace dick {
@@ -29,135 +61,3864 @@ inline ALLEGRO_COLOR dick_to_platform_color(const Color& x)
     return al_map_rgb_f(x.r, x.g, x.b);
 }
 
-class ResourcesImpl {
+// Deleters for the Allegro resources
 
-    // Deleters for the Allegro resources
-    // ----------------------------------
+struct FontDeleter {
+    void operator()(ALLEGRO_FONT *font)
+    {
+        LOG_DEBUG("Deleting font (%p)", font);
+        al_destroy_font(font);
+    }
+};
 
-    struct FontDeleter {
-        void operator()(ALLEGRO_FONT *font)
-        {
-            LOG_DEBUG("Deleting font (%p)", font);
-            al_destroy_font(font);
-        }
+struct BitmapDeleter {
+    void operator()(ALLEGRO_BITMAP *bitmap)
+    {
+        LOG_DEBUG("Deleting bitmap (%p)", bitmap);
+        al_destroy_bitmap(bitmap);
+    }
+};
+
+struct SampleDeleter {
+    void operator()(ALLEGRO_SAMPLE *sample)
+    {
+        LOG_DEBUG("Deleting sample (%p)", sample);
+        al_destroy_sample(sample);
+    }
+};
+
+struct AudioStreamDeleter {
+    void operator()(ALLEGRO_AUDIO_STREAM *stream)
+    {
+        LOG_DEBUG("Deleting audio stream (%p)", stream);
+        al_destroy_audio_stream(stream);
+    }
+};
+
+// Reads the entire file into memory using the Allegro file interface so that
+// the result is consistent with what the Allegro loaders would see.
+static std::shared_ptr<std::vector<char>> read_file(const std::string &path)
+{
+    ALLEGRO_FILE *file = al_fopen(path.c_str(), "rb");
+    if (!file) {
+        throw Error { std::string { "Failed opening file " } + path };
+    }
+
+    int64_t size = al_fsize(file);
+    auto result = std::make_shared<std::vector<char>>(size > 0 ? size : 0);
+    size_t read = al_fread(file, result->data(), result->size());
+    al_fclose(file);
+
+    if (size < 0 || read != result->size()) {
+        throw Error { std::string { "Failed reading file " } + path };
+    }
+
+    return result;
+}
+
+// Measures the time elapsed since the construction
+class Stopwatch {
+    std::chrono::steady_clock::time_point m_start;
+
+public:
+    Stopwatch() : m_start { std::chrono::steady_clock::now() } {}
+
+    std::uint64_t microseconds() const
+    {
+        return std::chrono::duration_cast<std::chrono::microseconds>(
+                std::chrono::steady_clock::now() - m_start).count();
+    }
+};
+
+// Profiler
+// --------
+
+std::atomic<bool> profiler_enabled { false };
+
+static std::uint64_t profile_clock_ns()
+{
+    static const auto epoch = std::chrono::steady_clock::now();
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::steady_clock::now() - epoch).count();
+}
+
+// Single producer ring of the most recent samples of a thread. The writer
+// claims a slot before overwriting it and publishes it afterwards, so that a
+// concurrent reader may discard the slots that could have changed under it.
+// The sample fields are atomic for the same reason.
+class ProfileRing {
+public:
+    static const std::uint64_t CAPACITY = 1 << 16;
+
+    struct Sample {
+        std::atomic<const char*> name;
+        std::atomic<std::uint64_t> start;
+        std::atomic<std::uint64_t> duration;
     };
 
-    struct BitmapDeleter {
-        void operator()(ALLEGRO_BITMAP *bitmap)
+private:
+    std::atomic<std::uint64_t> m_claimed;
+    std::atomic<std::uint64_t> m_head;
+    std::unique_ptr<Sample[]> m_samples;
+
+public:
+    const int tid;
+    std::string thread_name;
+
+    ProfileRing(int tid) :
+        m_claimed { 0 },
+        m_head { 0 },
+        tid { tid }
+    {}
+
+    // The samples are allocated upon the first push, published by the head
+    void push(const char *name, std::uint64_t start, std::uint64_t duration)
+    {
+        const std::uint64_t index = m_head.load(std::memory_order_relaxed);
+        if (!m_samples) {
+            m_samples.reset(new Sample[CAPACITY]);
+        }
+        m_claimed.store(index + 1, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_release);
+
+        Sample &sample = m_samples[index % CAPACITY];
+        sample.name.store(name, std::memory_order_relaxed);
+        sample.start.store(start, std::memory_order_relaxed);
+        sample.duration.store(duration, std::memory_order_relaxed);
+        m_head.store(index + 1, std::memory_order_release);
+    }
+
+    template <class Visit>
+    void read(Visit visit) const
+    {
+        struct Copy {
+            std::uint64_t index;
+            const char *name;
+            std::uint64_t start;
+            std::uint64_t duration;
+        };
+
+        const std::uint64_t head = m_head.load(std::memory_order_acquire);
+        if (!head) {
+            return;
+        }
+
+        const std::uint64_t first = head > CAPACITY ? head - CAPACITY : 0;
+        std::vector<Copy> copies;
+        copies.reserve(head - first);
+        for (std::uint64_t index = first; index < head; ++index) {
+            const Sample &sample = m_samples[index % CAPACITY];
+            copies.push_back({
+                index,
+                sample.name.load(std::memory_order_relaxed),
+                sample.start.load(std::memory_order_relaxed),
+                sample.duration.load(std::memory_order_relaxed) });
+        }
+
+        std::atomic_thread_fence(std::memory_order_acquire);
+        const std::uint64_t claimed = m_claimed.load(std::memory_order_relaxed);
+        for (const Copy &copy : copies) {
+            if (copy.index + CAPACITY >= claimed) {
+                visit(copy.name, copy.start, copy.duration);
+            }
+        }
+    }
+};
+
+class ProfileRegistry {
+    std::mutex m_mutex;
+    std::vector<std::shared_ptr<ProfileRing>> m_rings;
+
+    static void m_write_us(std::ostream &out, std::uint64_t ns)
+    {
+        char buffer[32];
+        std::snprintf(
+                buffer, sizeof(buffer), "%llu.%03u",
+                static_cast<unsigned long long>(ns / 1000),
+                static_cast<unsigned>(ns % 1000));
+        out << buffer;
+    }
+
+    static void m_write_string(std::ostream &out, const char *string)
+    {
+        out << '"';
+        for (const char *c = string; *c; ++c) {
+            if (*c == '"' || *c == '\\') {
+                out << '\\' << *c;
+            } else if (static_cast<unsigned char>(*c) >= 0x20) {
+                out << *c;
+            }
+        }
+        out << '"';
+    }
+
+public:
+    static ProfileRegistry &instance()
+    {
+        static ProfileRegistry registry;
+        return registry;
+    }
+
+    // The rings outlive their threads, so that their samples may be dumped
+    ProfileRing &thread_ring()
+    {
+        thread_local std::shared_ptr<ProfileRing> ring;
+        if (!ring) {
+            std::lock_guard<std::mutex> lock { m_mutex };
+            ring = std::make_shared<ProfileRing>(static_cast<int>(m_rings.size()) + 1);
+            m_rings.push_back(ring);
+        }
+        return *ring;
+    }
+
+    void name_thread(const std::string &name)
+    {
+        ProfileRing &ring = thread_ring();
+        std::lock_guard<std::mutex> lock { m_mutex };
+        ring.thread_name = name;
+    }
+
+    void dump(std::ostream &out)
+    {
+        std::vector<std::shared_ptr<ProfileRing>> rings;
+        std::vector<std::string> names;
         {
-            LOG_DEBUG("Deleting bitmap (%p)", bitmap);
-            al_destroy_bitmap(bitmap);
+            std::lock_guard<std::mutex> lock { m_mutex };
+            rings = m_rings;
+            for (const auto &ring : rings) {
+                names.push_back(ring->thread_name);
+            }
         }
-    };
 
-    // Object state
-    // ------------
+        bool first = true;
+        auto separate = [&out, &first]() {
+            if (!first) {
+                out << ",\n";
+            }
+            first = false;
+        };
 
-    Resources * const m_parent;
-    const std::string m_path_prefix;
-    std::map<std::string, std::unique_ptr<ALLEGRO_BITMAP, BitmapDeleter>> m_images;
-    std::map<std::pair<std::string, int>, std::unique_ptr<ALLEGRO_FONT, FontDeleter>> m_fonts;
+        out << "{\"traceEvents\":[\n";
+        for (std::size_t i = 0; i < rings.size(); ++i) {
+            const int tid = rings[i]->tid;
+            if (!names[i].empty()) {
+                separate();
+                out << "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":" << tid
+                    << ",\"args\":{\"name\":";
+                m_write_string(out, names[i].c_str());
+                out << "}}";
+            }
+            rings[i]->read([&](const char *name, std::uint64_t start, std::uint64_t duration) {
+                separate();
+                out << "{\"name\":";
+                m_write_string(out, name);
+                out << ",\"ph\":\"X\",\"pid\":1,\"tid\":" << tid << ",\"ts\":";
+                m_write_us(out, start);
+                out << ",\"dur\":";
+                m_write_us(out, duration);
+                out << "}";
+            });
+        }
+        out << "\n],\"displayTimeUnit\":\"ms\"}\n";
+    }
+};
 
-    ALLEGRO_BITMAP *m_load_image(const std::string &path)
+ProfileZone::ProfileZone(const char *name) :
+    m_name { profiler_enabled.load(std::memory_order_relaxed) ? name : nullptr },
+    m_start { m_name ? profile_clock_ns() : 0 }
+{}
+
+ProfileZone::~ProfileZone()
+{
+    if (m_name) {
+        const std::uint64_t end = profile_clock_ns();
+        ProfileRegistry::instance().thread_ring().push(m_name, m_start, end - m_start);
+    }
+}
+
+void enable_profiler(bool enabled)
+{
+    profile_clock_ns();
+    profiler_enabled.store(enabled);
+}
+
+void name_profiled_thread(const std::string &name) { ProfileRegistry::instance().name_thread(name); }
+
+void dump_profile_trace(std::ostream &out) { ProfileRegistry::instance().dump(out); }
+
+// 64 bit FNV-1a hash
+static std::uint64_t hash_bytes(const char *data, std::size_t size)
+{
+    std::uint64_t hash = 0xcbf29ce484222325ULL;
+    for (std::size_t i = 0; i < size; ++i) {
+        hash ^= static_cast<unsigned char>(data[i]);
+        hash *= 0x100000001b3ULL;
+    }
+    return hash;
+}
+
+// Decodes the image from the file contents; the format is told by the path's
+// extension. Returns null on failure.
+static ALLEGRO_BITMAP *decode_image(const std::vector<char> &data, const std::string &path)
+{
+    ALLEGRO_FILE *file = al_open_memfile(const_cast<char*>(data.data()), data.size(), "r");
+    if (!file) {
+        return nullptr;
+    }
+
+    const std::size_t dot = path.rfind('.');
+    const std::string ident = dot == std::string::npos ? std::string {} : path.substr(dot);
+    ALLEGRO_BITMAP *bitmap = al_load_bitmap_f(file, ident.c_str());
+    al_fclose(file);
+    return bitmap;
+}
+
+// Process-wide content addressed store of the images shared between the
+// Resources instances, which may not see each other and may use different
+// paths for the same file. The images are identified by the hash and the
+// size of the file contents and are kept as long as any instance uses them.
+class SharedImageStore {
+public:
+    typedef std::pair<std::uint64_t, std::size_t> Key;
+
+private:
+    std::mutex m_mutex;
+    std::map<Key, std::weak_ptr<ALLEGRO_BITMAP>> m_images;
+
+public:
+    static SharedImageStore &instance()
     {
-        std::string full_path = m_path_prefix + path;
-        ALLEGRO_BITMAP *bitmap = al_load_bitmap(full_path.c_str());
+        static SharedImageStore store;
+        return store;
+    }
+
+    static Key key(const std::vector<char> &data)
+    {
+        return { hash_bytes(data.data(), data.size()), data.size() };
+    }
+
+    // May be called from the worker threads; the bitmaps themselves are
+    // only ever touched on the main thread.
+    bool contains(const Key &key)
+    {
+        std::lock_guard<std::mutex> lock { m_mutex };
+        auto it = m_images.find(key);
+        return it != end(m_images) && !it->second.expired();
+    }
+
+    std::shared_ptr<ALLEGRO_BITMAP> find(const Key &key)
+    {
+        std::lock_guard<std::mutex> lock { m_mutex };
+        auto it = m_images.find(key);
+        return it != end(m_images) ? it->second.lock() : nullptr;
+    }
+
+    // Called before the bitmap's pixels change, as they no longer match the
+    // content it is stored under
+    void forget(const ALLEGRO_BITMAP *bitmap)
+    {
+        std::lock_guard<std::mutex> lock { m_mutex };
+        for (auto it = begin(m_images); it != end(m_images);) {
+            if (it->second.expired() || it->second.lock().get() == bitmap) {
+                it = m_images.erase(it);
+            } else {
+                ++it;
+            }
+        }
+    }
+
+    void insert(const Key &key, const std::shared_ptr<ALLEGRO_BITMAP> &bitmap)
+    {
+        std::lock_guard<std::mutex> lock { m_mutex };
+        for (auto it = begin(m_images); it != end(m_images);) {
+            if (it->second.expired()) {
+                it = m_images.erase(it);
+            } else {
+                ++it;
+            }
+        }
+        m_images[key] = bitmap;
+    }
+};
+
+// The contents of the files shared by the fonts of different sizes, possibly
+// living in different Resources instances. The data is kept as long as any
+// font uses it.
+static std::shared_ptr<std::vector<char>> shared_file_data(const std::string &path)
+{
+    static std::mutex mutex;
+    static std::map<std::string, std::weak_ptr<std::vector<char>>> files;
+
+    std::lock_guard<std::mutex> lock { mutex };
+
+    auto it = files.find(path);
+    if (it != end(files)) {
+        if (auto data = it->second.lock()) {
+            LOG_TRACE("Reusing file data (%s)", path.c_str());
+            return data;
+        }
+    }
+
+    // The expired entries are dropped on the way so that the map doesn't grow
+    // with every file ever read
+    for (auto expired = begin(files); expired != end(files);) {
+        if (expired->second.expired()) {
+            expired = files.erase(expired);
+        } else {
+            ++expired;
+        }
+    }
+
+    auto data = read_file(path);
+    files[path] = data;
+    return data;
+}
+
+static int64_t file_size(const std::string &path)
+{
+    ALLEGRO_FILE *file = al_fopen(path.c_str(), "rb");
+    if (!file) {
+        return 0;
+    }
+    int64_t size = al_fsize(file);
+    al_fclose(file);
+    return size > 0 ? size : 0;
+}
+
+// Asset archives
+// --------------
+
+// The archive layout is as follows (all the values in the host byte order):
+//   - the header,
+//   - the records describing the entries,
+//   - the blob of the entries' names, which are the paths the resources are
+//     requested with,
+//   - the entries' data, each aligned to 16 bytes.
+//
+// Images are stored as 32 bit pixels in the R, G, B, A byte order exactly as
+// produced by the Allegro loaders, i.e. with the alpha premultiplied. Fonts
+// are stored as the raw font files.
+
+enum class ArchiveRecordType : std::uint32_t {
+    IMAGE = 1,
+    FONT = 2
+};
+
+struct ArchiveHeader {
+    char magic[8];
+    std::uint32_t count;
+    std::uint32_t names_size;
+};
+
+struct ArchiveRecord {
+    ArchiveRecordType type;
+    std::uint32_t name_offset;
+    std::uint32_t name_size;
+    std::uint32_t width;
+    std::uint32_t height;
+    std::uint32_t reserved;
+    std::uint64_t offset;
+    std::uint64_t size;
+};
+
+const char archive_magic[8] = { 'D', 'I', 'C', 'K', 'P', 'A', 'K', '1' };
+
+inline std::uint64_t archive_align(std::uint64_t offset)
+{
+    return (offset + 15) & ~std::uint64_t { 15 };
+}
+
+inline bool is_font_path(const std::string &path)
+{
+    std::string::size_type dot = path.rfind('.');
+    if (dot == std::string::npos) {
+        return false;
+    }
+    std::string extension = path.substr(dot);
+    std::transform(begin(extension), end(extension), begin(extension), ::tolower);
+    return extension == ".ttf" || extension == ".otf" || extension == ".ttc";
+}
+
+// Read-only view of an entire file, memory mapped where supported
+class MappedFile {
+    const char *m_data;
+    std::size_t m_size;
+    std::shared_ptr<std::vector<char>> m_fallback;
+
+public:
+    MappedFile(const MappedFile&) = delete;
+    MappedFile &operator=(const MappedFile&) = delete;
+
+    MappedFile(const std::string &path) :
+        m_data { nullptr },
+        m_size { 0 }
+    {
+#       if DICK_MMAP
+        int fd = open(path.c_str(), O_RDONLY);
+        if (fd < 0) {
+            throw Error { std::string { "Failed opening file " } + path };
+        }
+
+        struct stat info;
+        if (fstat(fd, &info) != 0 || info.st_size <= 0) {
+            close(fd);
+            throw Error { std::string { "Failed reading file " } + path };
+        }
+
+        void *data = mmap(nullptr, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        close(fd);
+        if (data == MAP_FAILED) {
+            throw Error { std::string { "Failed mapping file " } + path };
+        }
+
+        m_data = static_cast<const char*>(data);
+        m_size = info.st_size;
+#       else
+        m_fallback = read_file(path);
+        m_data = m_fallback->data();
+        m_size = m_fallback->size();
+#       endif
+        LOG_DEBUG("Mapped file (%s) of %zu bytes", path.c_str(), m_size);
+    }
+
+    ~MappedFile()
+    {
+#       if DICK_MMAP
+        munmap(const_cast<char*>(m_data), m_size);
+#       endif
+    }
+
+    const char *data() const { return m_data; }
+    std::size_t size() const { return m_size; }
+};
+
+// The archives are shared with the tiled images streaming from them
+class AssetArchive : public std::enable_shared_from_this<AssetArchive> {
+    MappedFile m_file;
+    std::unordered_map<std::string, const ArchiveRecord*> m_records;
+
+public:
+    AssetArchive(const std::string &path) : m_file { path }
+    {
+        if (m_file.size() < sizeof(ArchiveHeader)) {
+            throw Error { std::string { "Truncated archive " } + path };
+        }
+
+        const ArchiveHeader *header = reinterpret_cast<const ArchiveHeader*>(m_file.data());
+        if (std::memcmp(header->magic, archive_magic, sizeof(archive_magic)) != 0) {
+            throw Error { std::string { "Not an asset archive " } + path };
+        }
+
+        const std::uint64_t names_begin =
+            sizeof(ArchiveHeader) + std::uint64_t { header->count } * sizeof(ArchiveRecord);
+        if (names_begin + header->names_size > m_file.size()) {
+            throw Error { std::string { "Truncated archive " } + path };
+        }
+
+        const ArchiveRecord *records = reinterpret_cast<const ArchiveRecord*>(
+                m_file.data() + sizeof(ArchiveHeader));
+        const char *names = m_file.data() + names_begin;
+
+        for (std::uint32_t i = 0; i < header->count; ++i) {
+            const ArchiveRecord &record = records[i];
+            bool valid =
+                std::uint64_t { record.name_offset } + record.name_size <= header->names_size &&
+                record.offset <= m_file.size() &&
+                record.size <= m_file.size() - record.offset &&
+                (record.type != ArchiveRecordType::IMAGE ||
+                 record.size == 4 * std::uint64_t { record.width } * record.height);
+            if (!valid) {
+                throw Error { std::string { "Corrupt record in archive " } + path };
+            }
+            m_records[std::string(names + record.name_offset, record.name_size)] = &record;
+        }
+
+        LOG_DEBUG("Mounted archive (%s) with %u entries", path.c_str(), header->count);
+    }
+
+    const ArchiveRecord *find(const std::string &name, ArchiveRecordType type) const
+    {
+        auto it = m_records.find(name);
+        return (it != end(m_records) && it->second->type == type) ? it->second : nullptr;
+    }
+
+    const char *data(const ArchiveRecord &record) const
+    {
+        return m_file.data() + record.offset;
+    }
+
+    ALLEGRO_BITMAP *create_image(const ArchiveRecord &record, const std::string &name) const
+    {
+        ALLEGRO_BITMAP *bitmap = al_create_bitmap(record.width, record.height);
         if (!bitmap) {
-            throw Error { std::string { "Failed loading image " } + full_path };
+            throw Error { std::string { "Failed creating archived image " } + name };
         }
-        LOG_DEBUG("Loaded image (%s)", full_path.c_str());
+
+        ALLEGRO_LOCKED_REGION *region = al_lock_bitmap(
+                bitmap, ALLEGRO_PIXEL_FORMAT_ABGR_8888_LE, ALLEGRO_LOCK_WRITEONLY);
+        if (!region) {
+            al_destroy_bitmap(bitmap);
+            throw Error { std::string { "Failed locking archived image " } + name };
+        }
+
+        const std::size_t row_size = 4 * record.width;
+        const char *source = m_file.data() + record.offset;
+        char *destination = static_cast<char*>(region->data);
+        for (std::uint32_t y = 0; y < record.height; ++y) {
+            std::memcpy(destination + y * region->pitch, source + y * row_size, row_size);
+        }
+
+        al_unlock_bitmap(bitmap);
+        LOG_DEBUG("Created image from archive (%s)", name.c_str());
         return bitmap;
     }
 
-    ALLEGRO_FONT *m_load_font(const std::string &path, int size)
+    ALLEGRO_FONT *create_font(const ArchiveRecord &record, const std::string &name, int size) const
     {
-        std::string full_path = m_path_prefix + path;
-        ALLEGRO_FONT *font = al_load_font(full_path.c_str(), -size, 0);
+        void *data = const_cast<char*>(m_file.data() + record.offset);
+        ALLEGRO_FILE *file = al_open_memfile(data, record.size, "r");
+        if (!file) {
+            throw Error { std::string { "Failed opening archived font " } + name };
+        }
+
+        // The file is owned by the font from now on, also in case of failure
+        ALLEGRO_FONT *font = al_load_ttf_font_f(file, name.c_str(), -size, 0);
         if (!font) {
-            throw Error { std::string { "Failed loading font " } + full_path };
+            throw Error { std::string { "Failed loading archived font " } + name };
         }
-        LOG_DEBUG("Loaded font (%s)", full_path.c_str());
+        LOG_DEBUG("Created font from archive (%s)", name.c_str());
         return font;
     }
+};
 
-public:
-    ResourcesImpl(const std::string &path_prefix, Resources *parent) :
-        m_parent { parent },
-        m_path_prefix { path_prefix }
-    {}
+void pack_archive(const std::string &archive_path, const std::vector<std::string> &paths)
+{
+    std::vector<ArchiveRecord> records;
+    std::vector<std::shared_ptr<std::vector<char>>> blobs;
+    std::string names;
 
-    void *get_image(const std::string &path, bool can_store)
-    {
-        LOG_TRACE("Getting image (%s)", path.c_str());
+    for (const std::string &path : paths) {
+        ArchiveRecord record {};
+        record.name_offset = names.size();
+        record.name_size = path.size();
+        names += path;
+
+        if (is_font_path(path)) {
+            record.type = ArchiveRecordType::FONT;
+            blobs.push_back(read_file(path));
+
+        } else {
+            record.type = ArchiveRecordType::IMAGE;
+
+            // The caller's flags are restored before anything may throw
+            const int flags = al_get_new_bitmap_flags();
+            al_set_new_bitmap_flags(ALLEGRO_MEMORY_BITMAP);
+            std::unique_ptr<ALLEGRO_BITMAP, BitmapDeleter> bitmap { al_load_bitmap(path.c_str()) };
+            al_set_new_bitmap_flags(flags);
+            if (!bitmap) {
+                throw Error { std::string { "Failed loading image " } + path };
+            }
+
+            record.width = al_get_bitmap_width(bitmap.get());
+            record.height = al_get_bitmap_height(bitmap.get());
+            const std::size_t row_size = 4 * record.width;
+
+            ALLEGRO_LOCKED_REGION *region = al_lock_bitmap(
+                    bitmap.get(), ALLEGRO_PIXEL_FORMAT_ABGR_8888_LE, ALLEGRO_LOCK_READONLY);
+            if (!region) {
+                throw Error { std::string { "Failed locking image " } + path };
+            }
+
+            auto pixels = std::make_shared<std::vector<char>>(row_size * record.height);
+            const char *source = static_cast<const char*>(region->data);
+            for (std::uint32_t y = 0; y < record.height; ++y) {
+                std::memcpy(pixels->data() + y * row_size, source + y * region->pitch, row_size);
+            }
+            al_unlock_bitmap(bitmap.get());
+
+            blobs.push_back(pixels);
+        }
+
+        record.size = blobs.back()->size();
+        records.push_back(record);
+        LOG_DEBUG("Packing (%s) of %zu bytes", path.c_str(), static_cast<std::size_t>(record.size));
+    }
+
+    ArchiveHeader header {};
+    std::memcpy(header.magic, archive_magic, sizeof(archive_magic));
+    header.count = records.size();
+    header.names_size = names.size();
+
+    std::uint64_t offset = archive_align(
+            sizeof(ArchiveHeader) + records.size() * sizeof(ArchiveRecord) + names.size());
+    for (auto &record : records) {
+        record.offset = offset;
+        offset = archive_align(offset + record.size);
+    }
+
+    std::ofstream output { archive_path, std::ios::binary | std::ios::trunc };
+    if (!output) {
+        throw Error { std::string { "Failed creating archive " } + archive_path };
+    }
+
+    const char padding[16] = {};
+    output.write(reinterpret_cast<const char*>(&header), sizeof(header));
+    output.write(reinterpret_cast<const char*>(records.data()), records.size() * sizeof(ArchiveRecord));
+    output.write(names.data(), names.size());
+    for (std::size_t i = 0; i < records.size(); ++i) {
+        output.write(padding, records[i].offset - output.tellp());
+        output.write(blobs[i]->data(), blobs[i]->size());
+    }
+
+    if (!output) {
+        throw Error { std::string { "Failed writing archive " } + archive_path };
+    }
+}
+
+// Every resource stored anywhere gets a unique generation number, so that a
+// handle can't be mistaken for a later incarnation of the same resource.
+static std::uint64_t next_generation()
+{
+    static std::atomic<std::uint64_t> counter { 0 };
+    return ++counter;
+}
+
+// Asynchronous loading facilities
+// -------------------------------
+
+class ResourceFutureImpl {
+public:
+    enum class State {
+        PENDING,
+        DECODED,
+        READY,
+        FAILED
+    };
+
+    std::mutex m_mutex;
+    std::condition_variable m_cv;
+    State m_state;
+    std::string m_error;
+    void *m_result;
+    std::uint64_t m_decode_us;
+    SharedImageStore::Key m_content_key;
+
+    // Products of the decoding stage performed by a worker thread
+    std::unique_ptr<ALLEGRO_BITMAP, BitmapDeleter> m_bitmap;
+    std::shared_ptr<std::vector<char>> m_file_data;
+
+    // The main thread stage which stores the decoded data at its destination.
+    // It is reset if the destination is destroyed before the finalization.
+    std::function<void*(ResourceFutureImpl&)> m_finalize;
+
+    // The futures a group future is composed of and the callbacks to be run
+    // on the main thread upon completion.
+    std::vector<std::shared_ptr<ResourceFutureImpl>> m_members;
+    std::vector<std::function<void(ResourceFutureImpl&)>> m_observers;
+
+    ResourceFutureImpl() :
+        m_state { State::PENDING },
+        m_result { nullptr },
+        m_decode_us { 0 },
+        m_content_key {}
+    {}
+
+    static std::shared_ptr<ResourceFutureImpl> make_ready(void *result)
+    {
+        auto future = std::make_shared<ResourceFutureImpl>();
+        future->m_state = State::READY;
+        future->m_result = result;
+        return future;
+    }
+
+    bool is_complete()
+    {
+        std::lock_guard<std::mutex> lock { m_mutex };
+        return m_state == State::READY || m_state == State::FAILED;
+    }
+
+    // Runs the observer upon completion or immediately if already complete
+    void observe(std::function<void(ResourceFutureImpl&)> observer)
+    {
+        if (is_complete()) {
+            observer(*this);
+        } else {
+            m_observers.push_back(std::move(observer));
+        }
+    }
+
+    void complete(void *result, const std::string &error)
+    {
+        {
+            std::lock_guard<std::mutex> lock { m_mutex };
+            m_result = result;
+            m_error = error;
+            m_state = error.empty() ? State::READY : State::FAILED;
+            m_cv.notify_all();
+        }
+
+        auto observers = std::move(m_observers);
+        m_observers.clear();
+        for (auto &observer : observers) {
+            observer(*this);
+        }
+    }
+
+    void on_decoded(const std::string &error)
+    {
+        std::lock_guard<std::mutex> lock { m_mutex };
+        m_error = error;
+        m_state = State::DECODED;
+        m_cv.notify_all();
+    }
+
+    void finalize()
+    {
+        {
+            std::lock_guard<std::mutex> lock { m_mutex };
+            if (m_state != State::DECODED) {
+                return;
+            }
+        }
+
+        void *result = nullptr;
+        std::string error;
+        try {
+            if (!m_finalize) {
+                throw Error { "Resources destroyed before the load has finished" };
+            }
+            result = m_finalize(*this);
+        } catch (const Error &e) {
+            error = e.what();
+        }
+
+        m_finalize = nullptr;
+        m_bitmap.reset();
+        m_file_data.reset();
+
+        complete(result, error);
+    }
+
+    // Blocks until the main thread completes the load; for the other
+    // threads, which may not finalize it by themselves.
+    void await_completion()
+    {
+        std::unique_lock<std::mutex> lock { m_mutex };
+        m_cv.wait(lock, [this]() { return m_state == State::READY || m_state == State::FAILED; });
+    }
+
+    void *wait()
+    {
+        // The members must be finalized here, as the main thread can't
+        // process the loads while blocked below.
+        for (auto &member : m_members) {
+            try {
+                member->wait();
+            } catch (const Error &) {
+            }
+        }
+
+        {
+            std::unique_lock<std::mutex> lock { m_mutex };
+            m_cv.wait(lock, [this]() { return m_state != State::PENDING; });
+        }
+
+        finalize();
+
+        if (m_state == State::FAILED) {
+            throw Error { m_error };
+        }
+        return m_result;
+    }
+};
+
+class AsyncLoader {
+    struct Job {
+        std::shared_ptr<ResourceFutureImpl> future;
+        std::function<void()> run;
+    };
+
+    std::mutex m_mutex;
+    std::condition_variable m_cv;
+    bool m_stop;
+    std::deque<Job> m_jobs;
+    std::deque<std::shared_ptr<ResourceFutureImpl>> m_decoded;
+    std::vector<std::thread> m_workers;
+
+    AsyncLoader() : m_stop { false } {}
+
+    void m_work()
+    {
+        name_profiled_thread("loader");
+        while (true) {
+            Job job;
+            {
+                std::unique_lock<std::mutex> lock { m_mutex };
+                m_cv.wait(lock, [this]() { return m_stop || !m_jobs.empty(); });
+                if (m_stop) {
+                    return;
+                }
+                job = std::move(m_jobs.front());
+                m_jobs.pop_front();
+            }
+            job.run();
+        }
+    }
+
+    void m_start_workers()
+    {
+        unsigned count = std::thread::hardware_concurrency();
+        count = count > 2 ? count - 1 : 1;
+        LOG_DEBUG("Starting %u loader threads", count);
+        for (unsigned i = 0; i < count; ++i) {
+            m_workers.emplace_back([this]() { m_work(); });
+        }
+    }
+
+public:
+    ~AsyncLoader()
+    {
+        {
+            std::lock_guard<std::mutex> lock { m_mutex };
+            m_stop = true;
+        }
+        m_cv.notify_all();
+        for (auto &worker : m_workers) {
+            worker.join();
+        }
+    }
+
+    static AsyncLoader &instance()
+    {
+        static AsyncLoader loader;
+        return loader;
+    }
+
+    // Stops the workers and fails both the loads whose jobs haven't started
+    // and the decoded ones, so that no bitmap outlives the library and no
+    // waiter is left blocked. The workers are started anew upon the next
+    // request.
+    void shutdown()
+    {
+        {
+            std::lock_guard<std::mutex> lock { m_mutex };
+            m_stop = true;
+        }
+        m_cv.notify_all();
+        for (auto &worker : m_workers) {
+            worker.join();
+        }
+
+        std::deque<Job> dropped;
+        std::deque<std::shared_ptr<ResourceFutureImpl>> decoded;
+        {
+            std::lock_guard<std::mutex> lock { m_mutex };
+            m_workers.clear();
+            dropped.swap(m_jobs);
+            decoded.swap(m_decoded);
+            m_stop = false;
+        }
+
+        // Failing the decoding lets the destinations forget the loads
+        for (auto &job : dropped) {
+            job.future->on_decoded("Loader shut down");
+            job.future->finalize();
+        }
+
+        for (auto &future : decoded) {
+            future->m_finalize = nullptr;
+            future->finalize();
+        }
+    }
+
+    // Runs the decoder on a worker thread and queues the future for the
+    // finalization on the main thread once the decoder is done.
+    void decode(
+            const std::shared_ptr<ResourceFutureImpl> &future,
+            std::function<void(ResourceFutureImpl&)> decoder)
+    {
+        std::lock_guard<std::mutex> lock { m_mutex };
+        if (m_workers.empty()) {
+            m_start_workers();
+        }
+
+        m_jobs.push_back({ future, [this, future, decoder]() {
+            std::string error;
+            Stopwatch stopwatch;
+            try {
+                DICK_PROFILE_SCOPE("decode");
+                decoder(*future);
+            } catch (const std::exception &e) {
+                error = e.what();
+            } catch (...) {
+                error = "Unknown error while loading";
+            }
+            future->m_decode_us = stopwatch.microseconds();
+            future->on_decoded(error);
+
+            std::lock_guard<std::mutex> lock { m_mutex };
+            m_decoded.push_back(future);
+        } });
+        m_cv.notify_one();
+    }
+
+    // Queues the future, which has nothing to decode, for the finalization
+    void post(const std::shared_ptr<ResourceFutureImpl> &future)
+    {
+        future->on_decoded({});
+        std::lock_guard<std::mutex> lock { m_mutex };
+        m_decoded.push_back(future);
+    }
+
+    void process(double time_budget)
+    {
+        {
+            std::lock_guard<std::mutex> lock { m_mutex };
+            if (m_decoded.empty()) {
+                return;
+            }
+        }
+
+        DICK_PROFILE_SCOPE("loads");
+        const double start = al_get_time();
+        do {
+            std::shared_ptr<ResourceFutureImpl> future;
+            {
+                std::lock_guard<std::mutex> lock { m_mutex };
+                if (m_decoded.empty()) {
+                    return;
+                }
+                future = std::move(m_decoded.front());
+                m_decoded.pop_front();
+            }
+            future->finalize();
+        } while (al_get_time() - start < time_budget);
+    }
+};
+
+bool ResourceFuture::is_ready() const { return m_impl->is_complete(); }
+
+void *ResourceFuture::get() { return m_impl->wait(); }
+
+void process_pending_loads(double time_budget) { AsyncLoader::instance().process(time_budget); }
+
+// Atlas page with a skyline bottom-left packer
+// --------------------------------------------
+
+class AtlasPage {
+
+    struct Segment {
+        int x, y, width;
+    };
+
+    // The padding prevents the neighbouring images from bleeding into each
+    // other when drawn with filtering.
+    static const int m_padding = 1;
+
+    std::unique_ptr<ALLEGRO_BITMAP, BitmapDeleter> m_bitmap;
+    int m_size;
+    std::vector<Segment> m_skyline;
+
+    bool m_fit(size_t index, int width, int height, int &y) const
+    {
+        if (m_skyline[index].x + width > m_size) {
+            return false;
+        }
+
+        y = m_skyline[index].y;
+        for (int remaining = width; remaining > 0; ++index) {
+            y = std::max(y, m_skyline[index].y);
+            if (y + height > m_size) {
+                return false;
+            }
+            remaining -= m_skyline[index].width;
+        }
+
+        return true;
+    }
+
+    void m_add_segment(size_t index, const Segment &segment)
+    {
+        m_skyline.insert(begin(m_skyline) + index, segment);
+
+        // Trim the segments shadowed by the new one
+        for (size_t i = index + 1; i < m_skyline.size();) {
+            const Segment &previous = m_skyline[i - 1];
+            Segment &current = m_skyline[i];
+            int overlap = previous.x + previous.width - current.x;
+            if (overlap <= 0) {
+                break;
+            }
+            if (current.width <= overlap) {
+                m_skyline.erase(begin(m_skyline) + i);
+            } else {
+                current.x += overlap;
+                current.width -= overlap;
+                break;
+            }
+        }
+
+        // Merge the neighbouring segments at the same level
+        for (size_t i = 0; i + 1 < m_skyline.size();) {
+            if (m_skyline[i].y == m_skyline[i + 1].y) {
+                m_skyline[i].width += m_skyline[i + 1].width;
+                m_skyline.erase(begin(m_skyline) + i + 1);
+            } else {
+                ++i;
+            }
+        }
+    }
+
+public:
+    AtlasPage(int size) :
+        m_bitmap { al_create_bitmap(size, size) },
+        m_size { size },
+        m_skyline { { 0, 0, size } }
+    {
+        if (!m_bitmap) {
+            throw Error { "Failed creating atlas page" };
+        }
+
+        ALLEGRO_STATE state;
+        al_store_state(&state, ALLEGRO_STATE_TARGET_BITMAP);
+        al_set_target_bitmap(m_bitmap.get());
+        al_clear_to_color(al_map_rgba(0, 0, 0, 0));
+        al_restore_state(&state);
+
+        LOG_DEBUG("Created atlas page (%p) %dx%d", m_bitmap.get(), size, size);
+    }
+
+    // Copies the image into the page and returns the sub-bitmap pointing at
+    // the copy or null if there is not enough room in this page.
+    ALLEGRO_BITMAP *insert(ALLEGRO_BITMAP *image)
+    {
+        const int width = al_get_bitmap_width(image);
+        const int height = al_get_bitmap_height(image);
+        const int padded_width = width + m_padding;
+        const int padded_height = height + m_padding;
+
+        size_t best_index = m_skyline.size();
+        int best_y = std::numeric_limits<int>::max();
+        int best_width = std::numeric_limits<int>::max();
+        for (size_t i = 0; i < m_skyline.size(); ++i) {
+            int y;
+            if (m_fit(i, padded_width, padded_height, y) &&
+                (y < best_y || (y == best_y && m_skyline[i].width < best_width))) {
+                best_index = i;
+                best_y = y;
+                best_width = m_skyline[i].width;
+            }
+        }
+
+        if (best_index == m_skyline.size()) {
+            return nullptr;
+        }
+
+        const int x = m_skyline[best_index].x;
+        const int y = best_y;
+        m_add_segment(best_index, { x, y + padded_height, padded_width });
+
+        ALLEGRO_STATE state;
+        al_store_state(&state, ALLEGRO_STATE_TARGET_BITMAP | ALLEGRO_STATE_BLENDER);
+        al_set_target_bitmap(m_bitmap.get());
+        al_set_blender(ALLEGRO_ADD, ALLEGRO_ONE, ALLEGRO_ZERO);
+        al_draw_bitmap(image, x, y, 0);
+        al_restore_state(&state);
+
+        return al_create_sub_bitmap(m_bitmap.get(), x, y, width, height);
+    }
+};
+
+// Interned resource keys
+// ----------------------
+
+typedef std::pair<std::string, int> FontKey;
+
+struct FontKeyHash {
+    size_t operator()(const FontKey &key) const
+    {
+        return std::hash<std::string> {}(key.first) * 31 + std::hash<int> {}(key.second);
+    }
+};
+
+// Maps the keys onto consecutive integers. The keys are stored in a deque so
+// that the references to them remain valid as the registry grows.
+template <class Key, class Hash = std::hash<Key>>
+class KeyRegistry {
+    mutable std::mutex m_mutex;
+    std::unordered_map<Key, std::uint32_t, Hash> m_ids;
+    std::deque<Key> m_keys;
+
+    std::uint32_t m_intern_locked(const Key &key)
+    {
+        std::lock_guard<std::mutex> lock { m_mutex };
+        auto it = m_ids.find(key);
+        if (it != end(m_ids)) {
+            return it->second;
+        }
+
+        std::uint32_t id = m_keys.size();
+        m_ids.emplace(key, id);
+        m_keys.push_back(key);
+        return id;
+    }
+
+public:
+    // The ids never change, so each thread remembers the ones it has already
+    // seen and only locks the registry for the new keys. There is a single
+    // registry per key type, hence the memo is per type as well.
+    std::uint32_t intern(const Key &key)
+    {
+        thread_local std::unordered_map<Key, std::uint32_t, Hash> seen;
+        auto it = seen.find(key);
+        if (it != end(seen)) {
+            return it->second;
+        }
+
+        std::uint32_t id = m_intern_locked(key);
+        seen.emplace(key, id);
+        return id;
+    }
+
+    const Key &key(std::uint32_t id) const
+    {
+        std::lock_guard<std::mutex> lock { m_mutex };
+        return m_keys[id];
+    }
+};
+
+static KeyRegistry<std::string> &image_registry()
+{
+    static KeyRegistry<std::string> registry;
+    return registry;
+}
+
+static KeyRegistry<FontKey, FontKeyHash> &font_registry()
+{
+    static KeyRegistry<FontKey, FontKeyHash> registry;
+    return registry;
+}
+
+ImageId intern_image(const std::string &path) { return ImageId { image_registry().intern(path) }; }
+FontId intern_font(const std::string &path, int size) { return FontId { font_registry().intern({ path, size }) }; }
+
+// Image variant kernels
+// ---------------------
+
+// The pixels in the R, G, B, A byte order with the alpha premultiplied, as
+// produced by the Allegro loaders. The kernels below are plain integer loops
+// over the contiguous rows which the compiler is able to vectorize.
+struct PixelBuffer {
+    int width, height;
+    std::vector<std::uint8_t> data;
+};
+
+static PixelBuffer read_pixels(ALLEGRO_BITMAP *bitmap)
+{
+    PixelBuffer result { al_get_bitmap_width(bitmap), al_get_bitmap_height(bitmap), {} };
+    const std::size_t row_size = 4 * static_cast<std::size_t>(result.width);
+    result.data.resize(row_size * result.height);
+
+    ALLEGRO_LOCKED_REGION *region = al_lock_bitmap(
+            bitmap, ALLEGRO_PIXEL_FORMAT_ABGR_8888_LE, ALLEGRO_LOCK_READONLY);
+    if (!region) {
+        throw Error { "Failed locking image" };
+    }
+
+    const char *source = static_cast<const char*>(region->data);
+    for (int y = 0; y < result.height; ++y) {
+        std::memcpy(result.data.data() + y * row_size, source + y * region->pitch, row_size);
+    }
+
+    al_unlock_bitmap(bitmap);
+    return result;
+}
+
+static ALLEGRO_BITMAP *create_bitmap(const PixelBuffer &pixels)
+{
+    ALLEGRO_BITMAP *bitmap = al_create_bitmap(pixels.width, pixels.height);
+    if (!bitmap) {
+        throw Error { "Failed creating image" };
+    }
+
+    ALLEGRO_LOCKED_REGION *region = al_lock_bitmap(
+            bitmap, ALLEGRO_PIXEL_FORMAT_ABGR_8888_LE, ALLEGRO_LOCK_WRITEONLY);
+    if (!region) {
+        al_destroy_bitmap(bitmap);
+        throw Error { "Failed locking image" };
+    }
+
+    const std::size_t row_size = 4 * static_cast<std::size_t>(pixels.width);
+    char *destination = static_cast<char*>(region->data);
+    for (int y = 0; y < pixels.height; ++y) {
+        std::memcpy(destination + y * region->pitch, pixels.data.data() + y * row_size, row_size);
+    }
+
+    al_unlock_bitmap(bitmap);
+    return bitmap;
+}
+
+// Averages the 2x2 blocks; repeated before the final resampling so that the
+// strong downscaling doesn't skip the source pixels.
+static PixelBuffer halve_pixels(const PixelBuffer &source)
+{
+    PixelBuffer result { std::max(1, source.width / 2), std::max(1, source.height / 2), {} };
+    result.data.resize(4 * static_cast<std::size_t>(result.width) * result.height);
+
+    const std::size_t pitch = 4 * static_cast<std::size_t>(source.width);
+    for (int y = 0; y < result.height; ++y) {
+        const std::uint8_t *top = source.data.data() + 2 * y * pitch;
+        const std::uint8_t *bottom = 2 * y + 1 < source.height ? top + pitch : top;
+        std::uint8_t *out = result.data.data() + 4 * y * static_cast<std::size_t>(result.width);
+        for (int x = 0; x < result.width; ++x) {
+            const int left = 8 * x;
+            const int right = 2 * x + 1 < source.width ? left + 4 : left;
+            for (int c = 0; c < 4; ++c) {
+                out[4 * x + c] = (top[left + c] + top[right + c] +
+                        bottom[left + c] + bottom[right + c] + 2) >> 2;
+            }
+        }
+    }
+
+    return result;
+}
+
+// Bilinear resampling combined with the tint and the flips in a single pass.
+// The weights are kept in 1/256ths.
+static PixelBuffer resample_pixels(
+        const PixelBuffer &source,
+        int width, int height,
+        const Color &tint,
+        int flags)
+{
+    PixelBuffer result { width, height, {} };
+    result.data.resize(4 * static_cast<std::size_t>(width) * height);
+
+    std::vector<int> columns(width), column_weights(width);
+    for (int x = 0; x < width; ++x) {
+        const double position = std::max(0.0, (x + 0.5) * source.width / width - 0.5);
+        columns[x] = std::min(static_cast<int>(position), source.width - 1);
+        column_weights[x] = static_cast<int>((position - columns[x]) * 256);
+    }
+
+    auto factor = [](double value) { return static_cast<int>(std::min(std::max(value, 0.0), 1.0) * 256); };
+    const int factors[4] = { factor(tint.r), factor(tint.g), factor(tint.b), 256 };
+
+    const std::size_t pitch = 4 * static_cast<std::size_t>(source.width);
+    for (int y = 0; y < height; ++y) {
+        const double position = std::max(0.0, (y + 0.5) * source.height / height - 0.5);
+        const int row = std::min(static_cast<int>(position), source.height - 1);
+        const int row_weight = static_cast<int>((position - row) * 256);
+
+        const std::uint8_t *top = source.data.data() + row * pitch;
+        const std::uint8_t *bottom = row + 1 < source.height ? top + pitch : top;
+
+        const int target_y = (flags & ImageFlip::VERTICAL) ? height - 1 - y : y;
+        std::uint8_t *out = result.data.data() + 4 * static_cast<std::size_t>(target_y) * width;
+
+        for (int x = 0; x < width; ++x) {
+            const int left = 4 * columns[x];
+            const int right = columns[x] + 1 < source.width ? left + 4 : left;
+            const int weight = column_weights[x];
+            const int target_x = (flags & ImageFlip::HORIZONTAL) ? width - 1 - x : x;
+            for (int c = 0; c < 4; ++c) {
+                const int upper = top[left + c] * (256 - weight) + top[right + c] * weight;
+                const int lower = bottom[left + c] * (256 - weight) + bottom[right + c] * weight;
+                const int value = (upper * (256 - row_weight) + lower * row_weight) >> 16;
+                out[4 * target_x + c] = (value * factors[c]) >> 8;
+            }
+        }
+    }
+
+    return result;
+}
+
+// QOI image format
+// ----------------
+
+// The "Quite OK Image" format is lossless like PNG and of similar size, but
+// decodes several times faster. The pixels are saved exactly as they are in
+// the bitmap, therefore the images to be converted should be loaded without
+// the alpha premultiplication (see the dickqoi tool), which is then applied
+// upon loading unless disabled with the loading flags.
+
+struct QoiPixel {
+    std::uint8_t r, g, b, a;
+
+    bool operator==(const QoiPixel &other) const
+    {
+        return r == other.r && g == other.g && b == other.b && a == other.a;
+    }
+};
+
+const char qoi_magic[4] = { 'q', 'o', 'i', 'f' };
+const std::size_t qoi_header_size = 14;
+const std::uint8_t qoi_end_marker[8] = { 0, 0, 0, 0, 0, 0, 0, 1 };
+const std::uint64_t qoi_max_pixels = 400000000;
+
+const std::uint8_t qoi_op_index = 0x00;
+const std::uint8_t qoi_op_diff = 0x40;
+const std::uint8_t qoi_op_luma = 0x80;
+const std::uint8_t qoi_op_run = 0xc0;
+const std::uint8_t qoi_op_rgb = 0xfe;
+const std::uint8_t qoi_op_rgba = 0xff;
+const std::uint8_t qoi_op_mask = 0xc0;
+
+static int qoi_hash(const QoiPixel &pixel)
+{
+    return (pixel.r * 3 + pixel.g * 5 + pixel.b * 7 + pixel.a * 11) % 64;
+}
+
+static std::uint32_t qoi_read_32(const std::uint8_t *bytes)
+{
+    return static_cast<std::uint32_t>(bytes[0]) << 24 | bytes[1] << 16 | bytes[2] << 8 | bytes[3];
+}
+
+static void qoi_write_32(std::vector<std::uint8_t> &bytes, std::uint32_t value)
+{
+    bytes.push_back(value >> 24);
+    bytes.push_back(value >> 16);
+    bytes.push_back(value >> 8);
+    bytes.push_back(value);
+}
+
+static PixelBuffer decode_qoi(const std::vector<std::uint8_t> &data, bool premultiply)
+{
+    if (data.size() < qoi_header_size + sizeof(qoi_end_marker) ||
+        std::memcmp(data.data(), qoi_magic, sizeof(qoi_magic)) != 0) {
+        throw Error { "Invalid QOI header" };
+    }
+
+    const std::uint32_t width = qoi_read_32(data.data() + 4);
+    const std::uint32_t height = qoi_read_32(data.data() + 8);
+    if (!width || !height || height > qoi_max_pixels / width) {
+        throw Error { "Invalid QOI image size" };
+    }
+
+    PixelBuffer result { static_cast<int>(width), static_cast<int>(height), {} };
+    result.data.resize(4 * static_cast<std::size_t>(width) * height);
+
+    // The chunks never reach into the end marker, so reading any chunk that
+    // starts before it is safe.
+    const std::size_t chunks_end = data.size() - sizeof(qoi_end_marker);
+    std::size_t position = qoi_header_size;
+
+    QoiPixel index[64] = {};
+    QoiPixel pixel { 0, 0, 0, 255 };
+    int run = 0;
+
+    for (std::uint8_t *out = result.data.data(); out != result.data.data() + result.data.size(); out += 4) {
+        if (run > 0) {
+            --run;
+        } else if (position < chunks_end) {
+            const std::uint8_t op = data[position++];
+            if (op == qoi_op_rgb) {
+                pixel.r = data[position];
+                pixel.g = data[position + 1];
+                pixel.b = data[position + 2];
+                position += 3;
+            } else if (op == qoi_op_rgba) {
+                pixel.r = data[position];
+                pixel.g = data[position + 1];
+                pixel.b = data[position + 2];
+                pixel.a = data[position + 3];
+                position += 4;
+            } else if ((op & qoi_op_mask) == qoi_op_index) {
+                pixel = index[op];
+            } else if ((op & qoi_op_mask) == qoi_op_diff) {
+                pixel.r += ((op >> 4) & 0x03) - 2;
+                pixel.g += ((op >> 2) & 0x03) - 2;
+                pixel.b += (op & 0x03) - 2;
+            } else if ((op & qoi_op_mask) == qoi_op_luma) {
+                const std::uint8_t next = data[position++];
+                const int green = (op & 0x3f) - 32;
+                pixel.r += green - 8 + ((next >> 4) & 0x0f);
+                pixel.g += green;
+                pixel.b += green - 8 + (next & 0x0f);
+            } else {
+                run = op & 0x3f;
+            }
+            index[qoi_hash(pixel)] = pixel;
+        }
+
+        if (premultiply) {
+            out[0] = (pixel.r * pixel.a + 127) / 255;
+            out[1] = (pixel.g * pixel.a + 127) / 255;
+            out[2] = (pixel.b * pixel.a + 127) / 255;
+        } else {
+            out[0] = pixel.r;
+            out[1] = pixel.g;
+            out[2] = pixel.b;
+        }
+        out[3] = pixel.a;
+    }
+
+    return result;
+}
+
+static std::vector<std::uint8_t> encode_qoi(const PixelBuffer &pixels)
+{
+    std::vector<std::uint8_t> result { qoi_magic, qoi_magic + sizeof(qoi_magic) };
+    result.reserve(qoi_header_size + pixels.data.size() + sizeof(qoi_end_marker));
+    qoi_write_32(result, pixels.width);
+    qoi_write_32(result, pixels.height);
+    result.push_back(4);
+    result.push_back(0);
+
+    QoiPixel index[64] = {};
+    QoiPixel previous { 0, 0, 0, 255 };
+    int run = 0;
+
+    const std::uint8_t *end = pixels.data.data() + pixels.data.size();
+    for (const std::uint8_t *in = pixels.data.data(); in != end; in += 4) {
+        const QoiPixel pixel { in[0], in[1], in[2], in[3] };
+
+        if (pixel == previous) {
+            if (++run == 62 || in + 4 == end) {
+                result.push_back(qoi_op_run | (run - 1));
+                run = 0;
+            }
+            continue;
+        }
+
+        if (run > 0) {
+            result.push_back(qoi_op_run | (run - 1));
+            run = 0;
+        }
+
+        const int hash = qoi_hash(pixel);
+        if (index[hash] == pixel) {
+            result.push_back(qoi_op_index | hash);
+
+        } else if (pixel.a == previous.a) {
+            index[hash] = pixel;
+            const int red = static_cast<std::int8_t>(pixel.r - previous.r);
+            const int green = static_cast<std::int8_t>(pixel.g - previous.g);
+            const int blue = static_cast<std::int8_t>(pixel.b - previous.b);
+            const int red_green = red - green;
+            const int blue_green = blue - green;
+
+            if (red >= -2 && red <= 1 && green >= -2 && green <= 1 && blue >= -2 && blue <= 1) {
+                result.push_back(qoi_op_diff | (red + 2) << 4 | (green + 2) << 2 | (blue + 2));
+            } else if (red_green >= -8 && red_green <= 7 &&
+                       green >= -32 && green <= 31 &&
+                       blue_green >= -8 && blue_green <= 7) {
+                result.push_back(qoi_op_luma | (green + 32));
+                result.push_back((red_green + 8) << 4 | (blue_green + 8));
+            } else {
+                result.push_back(qoi_op_rgb);
+                result.push_back(pixel.r);
+                result.push_back(pixel.g);
+                result.push_back(pixel.b);
+            }
+
+        } else {
+            index[hash] = pixel;
+            result.push_back(qoi_op_rgba);
+            result.push_back(pixel.r);
+            result.push_back(pixel.g);
+            result.push_back(pixel.b);
+            result.push_back(pixel.a);
+        }
+
+        previous = pixel;
+    }
+
+    result.insert(result.end(), qoi_end_marker, qoi_end_marker + sizeof(qoi_end_marker));
+    return result;
+}
+
+// The functions registered with the image add-on. The errors can't be
+// thrown through the add-on, so they are only logged.
+
+static ALLEGRO_BITMAP *load_qoi_f(ALLEGRO_FILE *file, int flags)
+{
+    std::vector<std::uint8_t> data;
+    std::uint8_t buffer[16384];
+    std::size_t read;
+    while ((read = al_fread(file, buffer, sizeof(buffer))) > 0) {
+        data.insert(data.end(), buffer, buffer + read);
+    }
+
+    try {
+        return create_bitmap(decode_qoi(data, !(flags & ALLEGRO_NO_PREMULTIPLIED_ALPHA)));
+    } catch (const Error &e) {
+        LOG_WARNING("Failed loading QOI image: %s", e.what());
+        return nullptr;
+    }
+}
+
+static ALLEGRO_BITMAP *load_qoi(const char *filename, int flags)
+{
+    ALLEGRO_FILE *file = al_fopen(filename, "rb");
+    if (!file) {
+        return nullptr;
+    }
+    ALLEGRO_BITMAP *bitmap = load_qoi_f(file, flags);
+    al_fclose(file);
+    return bitmap;
+}
+
+static bool save_qoi_f(ALLEGRO_FILE *file, ALLEGRO_BITMAP *bitmap)
+{
+    try {
+        const std::vector<std::uint8_t> data = encode_qoi(read_pixels(bitmap));
+        return al_fwrite(file, data.data(), data.size()) == data.size();
+    } catch (const Error &e) {
+        LOG_WARNING("Failed saving QOI image: %s", e.what());
+        return false;
+    }
+}
+
+static bool save_qoi(const char *filename, ALLEGRO_BITMAP *bitmap)
+{
+    ALLEGRO_FILE *file = al_fopen(filename, "wb");
+    if (!file) {
+        return false;
+    }
+    const bool result = save_qoi_f(file, bitmap);
+    return al_fclose(file) && result;
+}
+
+static bool identify_qoi(ALLEGRO_FILE *file)
+{
+    char magic[sizeof(qoi_magic)];
+    return al_fread(file, magic, sizeof(magic)) == sizeof(magic) &&
+           std::memcmp(magic, qoi_magic, sizeof(magic)) == 0;
+}
+
+void register_qoi_format()
+{
+    al_register_bitmap_loader(".qoi", load_qoi);
+    al_register_bitmap_loader_f(".qoi", load_qoi_f);
+    al_register_bitmap_saver(".qoi", save_qoi);
+    al_register_bitmap_saver_f(".qoi", save_qoi_f);
+    al_register_bitmap_identifier(".qoi", identify_qoi);
+}
+
+// File watching
+// -------------
+
+// Watches the files for modifications and reports them on a background
+// thread along with the ids they have been registered with. The directories
+// rather than the files are watched, as the editors often replace the files
+// instead of writing to them.
+class FileWatcher {
+public:
+    typedef std::function<void(std::uint32_t, const std::string&)> Callback;
+
+private:
+    typedef std::pair<int, std::string> WatchedName;
+
+    Callback m_on_change;
+    int m_fd;
+    std::mutex m_mutex;
+    std::map<std::string, int> m_directories;
+    std::map<WatchedName, std::vector<std::pair<std::uint32_t, std::string>>> m_files;
+    std::atomic<bool> m_stop;
+    std::thread m_thread;
+
+#if DICK_INOTIFY
+    void m_run()
+    {
+        alignas(inotify_event) char buffer[4096];
+        pollfd descriptor { m_fd, POLLIN, 0 };
+
+        while (!m_stop) {
+            if (poll(&descriptor, 1, 100) <= 0) {
+                continue;
+            }
+
+            ssize_t size = read(m_fd, buffer, sizeof(buffer));
+            for (ssize_t offset = 0; offset < size;) {
+                const inotify_event *event = reinterpret_cast<const inotify_event*>(buffer + offset);
+                offset += sizeof(inotify_event) + event->len;
+                if (!event->len) {
+                    continue;
+                }
+
+                std::vector<std::pair<std::uint32_t, std::string>> changed;
+                {
+                    std::lock_guard<std::mutex> lock { m_mutex };
+                    auto it = m_files.find({ event->wd, event->name });
+                    if (it != end(m_files)) {
+                        changed = it->second;
+                    }
+                }
+
+                for (const auto &file : changed) {
+                    LOG_DEBUG("File changed (%s)", file.second.c_str());
+                    m_on_change(file.first, file.second);
+                }
+            }
+        }
+    }
+#endif
+
+public:
+    FileWatcher(Callback on_change) :
+        m_on_change { std::move(on_change) },
+        m_fd { -1 },
+        m_stop { false }
+    {
+#if DICK_INOTIFY
+        m_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+        if (m_fd < 0) {
+            throw Error { "Failed initializing inotify" };
+        }
+        m_thread = std::thread { [this]() { m_run(); } };
+#else
+        LOG_WARNING("File watching is not supported on this platform");
+#endif
+    }
+
+    ~FileWatcher()
+    {
+#if DICK_INOTIFY
+        m_stop = true;
+        m_thread.join();
+        close(m_fd);
+#endif
+    }
+
+    void watch(const std::string &path, std::uint32_t id)
+    {
+#if DICK_INOTIFY
+        const std::size_t slash = path.rfind('/');
+        const std::string directory = slash == std::string::npos ? "." : path.substr(0, slash + 1);
+        const std::string name = slash == std::string::npos ? path : path.substr(slash + 1);
+
+        std::lock_guard<std::mutex> lock { m_mutex };
+
+        auto it = m_directories.find(directory);
+        if (it == end(m_directories)) {
+            int wd = inotify_add_watch(m_fd, directory.c_str(), IN_CLOSE_WRITE | IN_MOVED_TO);
+            if (wd < 0) {
+                LOG_WARNING("Failed watching directory (%s)", directory.c_str());
+                return;
+            }
+            it = m_directories.emplace(directory, wd).first;
+        }
+
+        auto &ids = m_files[{ it->second, name }];
+        for (const auto &file : ids) {
+            if (file.first == id) {
+                return;
+            }
+        }
+        ids.emplace_back(id, path);
+#else
+        (void)path;
+        (void)id;
+#endif
+    }
+};
+
+// Tiled images
+// ------------
+
+// The tiles are cut out of the image's pixels, which are either the mapped
+// archive entry or, for the images that aren't archived, the whole image
+// decoded in the background up front. The cutting is done by the loader
+// workers and only the upload happens on the main thread.
+class TiledImageImpl : public std::enable_shared_from_this<TiledImageImpl> {
+
+    struct Tile {
+        std::unique_ptr<ALLEGRO_BITMAP, BitmapDeleter> bitmap;
+        std::uint64_t last_use;
+    };
+
+    // The pending tiles that have left the view are no longer wanted, so
+    // that their cutting is skipped if it hasn't started yet.
+    struct PendingTile {
+        std::shared_ptr<ResourceFutureImpl> future;
+        std::shared_ptr<std::atomic<bool>> wanted;
+    };
+
+    const std::string m_name;
+    const int m_tile_size;
+    const std::size_t m_max_tiles;
+
+    // Zero size until the source is available
+    int m_width, m_height;
+    std::shared_ptr<const void> m_source_owner;
+    const char *m_pixels;
+    std::size_t m_pitch;
+
+    std::map<std::uint32_t, Tile> m_tiles;
+    std::map<std::uint32_t, PendingTile> m_pending;
+    std::uint64_t m_use_clock;
+    std::uint64_t m_view_stamp;
+
+    int m_columns() const { return (m_width + m_tile_size - 1) / m_tile_size; }
+    int m_rows() const { return (m_height + m_tile_size - 1) / m_tile_size; }
+
+    // Evicts the least recently used tiles except the ones in the current
+    // view, which may therefore temporarily exceed the limit.
+    void m_evict()
+    {
+        while (m_tiles.size() > m_max_tiles) {
+            auto lru = end(m_tiles);
+            for (auto it = begin(m_tiles); it != end(m_tiles); ++it) {
+                if (it->second.last_use < m_view_stamp &&
+                    (lru == end(m_tiles) || it->second.last_use < lru->second.last_use)) {
+                    lru = it;
+                }
+            }
+            if (lru == end(m_tiles)) {
+                return;
+            }
+            m_tiles.erase(lru);
+        }
+    }
+
+    // The tile may be wanted again only after the worker has skipped it, in
+    // which case it is left to the next request to queue it anew.
+    void *m_store_tile(std::uint32_t key, const PixelBuffer &pixels, bool wanted)
+    {
+        m_pending.erase(key);
+        if (!wanted || pixels.data.empty()) {
+            return nullptr;
+        }
+
+        ALLEGRO_BITMAP *bitmap = create_bitmap(pixels);
+        Tile &tile = m_tiles[key];
+        tile.bitmap.reset(bitmap);
+        tile.last_use = ++m_use_clock;
+        m_evict();
+        return static_cast<void*>(bitmap);
+    }
+
+    void m_load_tile(int column, int row)
+    {
+        const std::uint32_t key = row * m_columns() + column;
+        const int x = column * m_tile_size;
+        const int y = row * m_tile_size;
+
+        auto pixels = std::make_shared<PixelBuffer>(PixelBuffer {
+                std::min(m_tile_size, m_width - x), std::min(m_tile_size, m_height - y), {} });
+        auto wanted = std::make_shared<std::atomic<bool>>(true);
+
+        auto future = std::make_shared<ResourceFutureImpl>();
+        std::weak_ptr<TiledImageImpl> weak = shared_from_this();
+        future->m_finalize = [weak, key, pixels, wanted](ResourceFutureImpl &future) -> void* {
+            auto self = weak.lock();
+            if (!self) {
+                throw Error { "Tiled image destroyed before the tile has been loaded" };
+            }
+            void *tile = self->m_store_tile(key, *pixels, *wanted);
+            if (!future.m_error.empty()) {
+                throw Error { future.m_error };
+            }
+            return tile;
+        };
+
+        std::shared_ptr<const void> owner = m_source_owner;
+        const char *source = m_pixels + y * m_pitch + 4 * static_cast<std::size_t>(x);
+        const std::size_t pitch = m_pitch;
+        AsyncLoader::instance().decode(future, [owner, source, pitch, pixels, wanted](ResourceFutureImpl &) {
+            if (!*wanted) {
+                return;
+            }
+            const std::size_t row_size = 4 * static_cast<std::size_t>(pixels->width);
+            pixels->data.resize(row_size * pixels->height);
+            for (int y = 0; y < pixels->height; ++y) {
+                std::memcpy(pixels->data.data() + y * row_size, source + y * pitch, row_size);
+            }
+        });
+
+        m_pending[key] = { future, wanted };
+    }
+
+public:
+    TiledImageImpl(const std::string &name, int tile_size, int max_tiles) :
+        m_name { name },
+        m_tile_size { tile_size },
+        m_max_tiles { static_cast<std::size_t>(max_tiles) },
+        m_width { 0 },
+        m_height { 0 },
+        m_pixels { nullptr },
+        m_pitch { 0 },
+        m_use_clock { 0 },
+        m_view_stamp { 0 }
+    {
+        if (tile_size <= 0 || max_tiles <= 0) {
+            throw Error { std::string { "Invalid tiling of image " } + name };
+        }
+    }
+
+    ~TiledImageImpl()
+    {
+        for (auto &pair : m_pending) {
+            *pair.second.wanted = false;
+        }
+    }
+
+    void set_source(std::shared_ptr<const void> owner, const char *pixels, int width, int height)
+    {
+        m_source_owner = std::move(owner);
+        m_pixels = pixels;
+        m_pitch = 4 * static_cast<std::size_t>(width);
+        m_width = width;
+        m_height = height;
+        LOG_DEBUG("Tiled image (%s) of %dx%d available", m_name.c_str(), width, height);
+    }
+
+    void load_source(const std::string &full_path)
+    {
+        auto pixels = std::make_shared<PixelBuffer>();
+        auto future = std::make_shared<ResourceFutureImpl>();
+        std::weak_ptr<TiledImageImpl> weak = shared_from_this();
+
+        future->m_finalize = [weak, pixels](ResourceFutureImpl &future) -> void* {
+            auto self = weak.lock();
+            if (!future.m_error.empty()) {
+                LOG_WARNING("%s", future.m_error.c_str());
+                throw Error { future.m_error };
+            }
+            if (self) {
+                const char *data = reinterpret_cast<const char*>(pixels->data.data());
+                self->set_source(pixels, data, pixels->width, pixels->height);
+            }
+            return nullptr;
+        };
+
+        AsyncLoader::instance().decode(future, [full_path, pixels](ResourceFutureImpl &) {
+            al_set_new_bitmap_flags(ALLEGRO_MEMORY_BITMAP);
+            std::unique_ptr<ALLEGRO_BITMAP, BitmapDeleter> bitmap { al_load_bitmap(full_path.c_str()) };
+            if (!bitmap) {
+                throw Error { std::string { "Failed loading image " } + full_path };
+            }
+            *pixels = read_pixels(bitmap.get());
+        });
+    }
+
+    int width() const { return m_width; }
+    int height() const { return m_height; }
+    int tile_size() const { return m_tile_size; }
+
+    void request(double x, double y, double width, double height)
+    {
+        m_view_stamp = ++m_use_clock;
+
+        if (!m_pixels || width <= 0 || height <= 0) {
+            for (auto &pair : m_pending) {
+                *pair.second.wanted = false;
+            }
+            return;
+        }
+
+        const int first_column = std::max(0, static_cast<int>(std::floor(x / m_tile_size)));
+        const int first_row = std::max(0, static_cast<int>(std::floor(y / m_tile_size)));
+        const int last_column = std::min(m_columns() - 1, static_cast<int>(std::ceil((x + width) / m_tile_size)) - 1);
+        const int last_row = std::min(m_rows() - 1, static_cast<int>(std::ceil((y + height) / m_tile_size)) - 1);
+
+        // The tiles still in view stay wanted throughout, so that the workers
+        // never skip them
+        for (auto &pair : m_pending) {
+            const int column = pair.first % m_columns();
+            const int row = pair.first / m_columns();
+            *pair.second.wanted =
+                column >= first_column && column <= last_column &&
+                row >= first_row && row <= last_row;
+        }
+
+        for (int row = first_row; row <= last_row; ++row) {
+            for (int column = first_column; column <= last_column; ++column) {
+                const std::uint32_t key = row * m_columns() + column;
+                auto tile = m_tiles.find(key);
+                if (tile != end(m_tiles)) {
+                    tile->second.last_use = m_view_stamp;
+                } else if (m_pending.find(key) == end(m_pending)) {
+                    m_load_tile(column, row);
+                }
+            }
+        }
+    }
+
+    void *get_tile(int column, int row) const
+    {
+        if (column < 0 || row < 0 || column >= m_columns() || row >= m_rows()) {
+            return nullptr;
+        }
+        auto tile = m_tiles.find(row * m_columns() + column);
+        return tile != end(m_tiles) ? static_cast<void*>(tile->second.bitmap.get()) : nullptr;
+    }
+
+    void draw_region(double sx, double sy, double sw, double sh, double dx, double dy)
+    {
+        request(sx, sy, sw, sh);
+
+        for (const auto &pair : m_tiles) {
+            const double tile_x = (pair.first % m_columns()) * m_tile_size;
+            const double tile_y = (pair.first / m_columns()) * m_tile_size;
+            ALLEGRO_BITMAP *bitmap = pair.second.bitmap.get();
+
+            const double left = std::max(sx, tile_x);
+            const double top = std::max(sy, tile_y);
+            const double right = std::min(sx + sw, tile_x + al_get_bitmap_width(bitmap));
+            const double bottom = std::min(sy + sh, tile_y + al_get_bitmap_height(bitmap));
+            if (left >= right || top >= bottom) {
+                continue;
+            }
+
+            al_draw_bitmap_region(
+                    bitmap,
+                    left - tile_x, top - tile_y,
+                    right - left, bottom - top,
+                    dx + left - sx, dy + top - sy,
+                    0);
+        }
+    }
+};
+
+int TiledImage::width() const { return m_impl->width(); }
+int TiledImage::height() const { return m_impl->height(); }
+int TiledImage::tile_size() const { return m_impl->tile_size(); }
+void TiledImage::request(double x, double y, double width, double height) { m_impl->request(x, y, width, height); }
+void *TiledImage::get_tile(int column, int row) const { return m_impl->get_tile(column, row); }
+void TiledImage::draw_region(double sx, double sy, double sw, double sh, double dx, double dy) {
+    m_impl->draw_region(sx, sy, sw, sh, dx, dy);
+}
+
+// Audio streams
+// -------------
+
+class AudioStreamImpl {
+    std::unique_ptr<ALLEGRO_AUDIO_STREAM, AudioStreamDeleter> m_stream;
+
+public:
+    AudioStreamImpl(const std::string &path, int buffer_count, int buffer_samples) :
+        m_stream { al_load_audio_stream(path.c_str(), buffer_count, buffer_samples) }
+    {
+        if (!m_stream) {
+            throw Error { std::string { "Failed opening audio stream " } + path };
+        }
+
+        // The streams start playing as soon as they are attached
+        al_set_audio_stream_playing(m_stream.get(), false);
+        if (!al_attach_audio_stream_to_mixer(m_stream.get(), al_get_default_mixer())) {
+            throw Error { std::string { "Failed attaching audio stream " } + path };
+        }
+        LOG_DEBUG("Opened audio stream (%s)", path.c_str());
+    }
+
+    void play(bool loop)
+    {
+        al_set_audio_stream_playmode(m_stream.get(), loop ? ALLEGRO_PLAYMODE_LOOP : ALLEGRO_PLAYMODE_ONCE);
+        al_set_audio_stream_playing(m_stream.get(), true);
+    }
+
+    void stop()
+    {
+        al_set_audio_stream_playing(m_stream.get(), false);
+        al_rewind_audio_stream(m_stream.get());
+    }
+
+    void pause() { al_set_audio_stream_playing(m_stream.get(), false); }
+    bool is_playing() const { return al_get_audio_stream_playing(m_stream.get()); }
+    void set_gain(double gain) { al_set_audio_stream_gain(m_stream.get(), gain); }
+    void *get() const { return static_cast<void*>(m_stream.get()); }
+};
+
+void AudioStream::play(bool loop) { m_impl->play(loop); }
+void AudioStream::pause() { m_impl->pause(); }
+void AudioStream::stop() { m_impl->stop(); }
+bool AudioStream::is_playing() const { return m_impl->is_playing(); }
+void AudioStream::set_gain(double gain) { m_impl->set_gain(gain); }
+void *AudioStream::get() const { return m_impl->get(); }
+
+// Concurrent lookup table
+// -----------------------
+
+// Table of pointers indexed with the interned ids, readable without waiting.
+// The pages are allocated as needed and neither moved nor freed before the
+// table, so only the writers need to be synchronized. The ids beyond the
+// table's capacity are simply never found.
+class ConcurrentSlots {
+    static const std::size_t m_page_size = 1024;
+    static const std::size_t m_page_count = 4096;
+
+    std::unique_ptr<std::atomic<std::atomic<void*>*>[]> m_pages;
+
+public:
+    ConcurrentSlots() : m_pages { new std::atomic<std::atomic<void*>*>[m_page_count] }
+    {
+        for (std::size_t i = 0; i < m_page_count; ++i) {
+            m_pages[i].store(nullptr, std::memory_order_relaxed);
+        }
+    }
+
+    ~ConcurrentSlots()
+    {
+        for (std::size_t i = 0; i < m_page_count; ++i) {
+            delete[] m_pages[i].load(std::memory_order_relaxed);
+        }
+    }
+
+    void *load(std::uint32_t index) const
+    {
+        if (index / m_page_size >= m_page_count) {
+            return nullptr;
+        }
+        std::atomic<void*> *page = m_pages[index / m_page_size].load(std::memory_order_acquire);
+        return page ? page[index % m_page_size].load(std::memory_order_acquire) : nullptr;
+    }
+
+    void store(std::uint32_t index, void *value)
+    {
+        if (index / m_page_size >= m_page_count) {
+            return;
+        }
+        std::atomic<std::atomic<void*>*> &slot = m_pages[index / m_page_size];
+        std::atomic<void*> *page = slot.load(std::memory_order_relaxed);
+        if (!page) {
+            page = new std::atomic<void*>[m_page_size];
+            for (std::size_t i = 0; i < m_page_size; ++i) {
+                page[i].store(nullptr, std::memory_order_relaxed);
+            }
+            slot.store(page, std::memory_order_release);
+        }
+        page[index % m_page_size].store(value, std::memory_order_release);
+    }
+};
+
+// Resources implementation
+// ------------------------
+
+class ResourcesImpl {
+
+    // The entries track the approximate memory footprint and the use order
+    // of the resources for the sake of the eviction under a memory budget.
+    // The entries charged to the budget are listed from the least recently
+    // used one.
+    struct LruKey {
+        bool is_font;
+        std::uint32_t index;
+    };
+    typedef std::list<LruKey> Lru;
+
+    // The images may be shared with other instances through the
+    // process-wide store.
+    struct ImageEntry {
+        ResourcesImpl *owner;
+        std::shared_ptr<ALLEGRO_BITMAP> bitmap;
+        std::size_t bytes;
+        Lru::iterator lru;
+        bool listed;
+        std::uint64_t generation;
+        std::uint32_t load_count;
+        std::uint64_t decode_us;
+
+        // Changes along with the generation, but also upon the in place reload
+        std::uint64_t revision;
+    };
+
+    // The font loaded from memory must not outlive the buffer it is read from
+    struct FontEntry {
+        ResourcesImpl *owner;
+        std::shared_ptr<std::vector<char>> data;
+        std::unique_ptr<ALLEGRO_FONT, FontDeleter> font;
+        const void *face;
+        std::size_t bytes;
+        Lru::iterator lru;
+        bool listed;
+        std::uint64_t generation;
+        std::uint32_t load_count;
+        std::uint64_t decode_us;
+    };
+
+    // Object state
+    // ------------
+
+    Resources * const m_parent;
+    const std::string m_path_prefix;
+
+    // The archives must outlive the fonts which read their mapped memory
+    std::vector<std::shared_ptr<AssetArchive>> m_archives;
+
+    // The atlas pages must outlive the images, which may be their sub-bitmaps
+    int m_atlas_page_size;
+    int m_atlas_max_image_size;
+    std::vector<std::unique_ptr<AtlasPage>> m_atlas_pages;
+
+    bool m_share_images;
+
+    // The resources are indexed with the interned keys' ids. The deques keep
+    // the entries in place as they grow.
+    std::deque<ImageEntry> m_images;
+    std::deque<FontEntry> m_fonts;
+
+    // The baked fonts are identified by the path, size and character range
+    typedef std::tuple<std::string, int, int, int> BakedFontKey;
+    std::map<BakedFontKey, FontEntry> m_baked_fonts;
+
+    // The samples are few and short, so they are neither interned nor
+    // subject to the memory budget.
+    std::map<std::string, std::unique_ptr<ALLEGRO_SAMPLE, SampleDeleter>> m_samples;
+
+    // The variants are identified by the original's id, the scale, the tint
+    // and the flags, and recreated whenever the original's revision changes.
+    // They don't count towards the resident bytes, as they aren't evicted.
+    typedef std::tuple<std::uint32_t, double, double, double, double, int> VariantKey;
+    struct VariantEntry {
+        ImageEntry image;
+        std::uint64_t source_revision;
+    };
+    std::map<VariantKey, VariantEntry> m_image_variants;
+    std::string m_glyph_cache_dir;
+    std::map<std::uint32_t, std::shared_ptr<ResourceFutureImpl>> m_pending_images;
+    std::map<std::uint32_t, std::shared_ptr<ResourceFutureImpl>> m_pending_fonts;
+
+    // The watcher reports the changes on its own thread, hence the reloads
+    // it requests are guarded by a separate mutex.
+    std::unique_ptr<FileWatcher> m_watcher;
+    std::mutex m_reload_mutex;
+    std::map<std::uint32_t, std::shared_ptr<ResourceFutureImpl>> m_pending_reloads;
+
+    // The results of the lookups in the parents, including the negative ones,
+    // are cached per id. The version counter is shared by the whole tree and
+    // bumped by every instance that has children whenever it stores or drops
+    // a resource, which invalidates all the cached entries at once.
+    template <class Entry>
+    struct ParentCacheEntry {
+        Entry *entry;
+        std::uint64_t version;
+    };
+
+    std::shared_ptr<std::atomic<std::uint64_t>> m_tree_version;
+    std::vector<ResourcesImpl*> m_children;
+    std::vector<ParentCacheEntry<ImageEntry>> m_parent_images;
+    std::vector<ParentCacheEntry<FontEntry>> m_parent_fonts;
+
+    ResourceStats m_stats;
+
+    // Concurrent mode state. The pointers to the stored resources are
+    // published for the lock-free lookups, while everything else is guarded
+    // by the mutex. The flights are the resources being loaded by the
+    // threads other than the main one, along with the futures handed out by
+    // the asynchronous getters meanwhile, if any, to be completed once the
+    // flights land.
+    typedef std::map<std::uint32_t, std::shared_ptr<ResourceFutureImpl>> Flights;
+    bool m_concurrent;
+    std::thread::id m_main_thread;
+    std::recursive_mutex m_mutex;
+    std::condition_variable_any m_flights_cv;
+    ConcurrentSlots m_image_slots;
+    ConcurrentSlots m_font_slots;
+    Flights m_image_flights;
+    Flights m_font_flights;
+    std::vector<std::shared_ptr<ResourceFutureImpl>> m_pending_conversions;
+
+    // Memory budget state
+    std::size_t m_memory_budget;
+    std::size_t m_resident_bytes;
+    std::size_t m_atlas_bytes;
+    Lru m_lru;
+    std::map<const void*, std::size_t> m_face_users;
+
+    ImageEntry *m_find_image(ImageId id)
+    {
+        if (id.index < m_images.size() && m_images[id.index].bitmap) {
+            ImageEntry &entry = m_images[id.index];
+            m_touch(entry);
+            return &entry;
+        }
+        return nullptr;
+    }
+
+    FontEntry *m_find_font(FontId id)
+    {
+        if (id.index < m_fonts.size() && m_fonts[id.index].font) {
+            FontEntry &entry = m_fonts[id.index];
+            m_touch(entry);
+            return &entry;
+        }
+        return nullptr;
+    }
+
+    // Unlike the lookups above, doesn't count as a use of the resource
+    const ImageEntry *m_peek_image(ImageId id)
+    {
+        if (id.index < m_images.size() && m_images[id.index].bitmap) {
+            return &m_images[id.index];
+        }
+        if (!m_parent) {
+            return nullptr;
+        }
+        auto lock = m_parent->m_impl->guard();
+        return m_parent->m_impl->m_peek_image(id);
+    }
+
+    const FontEntry *m_peek_font(FontId id)
+    {
+        if (id.index < m_fonts.size() && m_fonts[id.index].font) {
+            return &m_fonts[id.index];
+        }
+        if (!m_parent) {
+            return nullptr;
+        }
+        auto lock = m_parent->m_impl->guard();
+        return m_parent->m_impl->m_peek_font(id);
+    }
+
+    template <class Entry>
+    void m_list(Entry &entry, LruKey key)
+    {
+        if (entry.bytes) {
+            entry.lru = m_lru.insert(end(m_lru), key);
+            entry.listed = true;
+        }
+    }
+
+    template <class Entry>
+    void m_unlist(Entry &entry)
+    {
+        if (entry.listed) {
+            m_lru.erase(entry.lru);
+            entry.listed = false;
+        }
+    }
+
+    template <class Entry>
+    void m_touch(Entry &entry)
+    {
+        if (entry.listed) {
+            m_lru.splice(end(m_lru), m_lru, entry.lru);
+        }
+    }
+
+    template <class Entry>
+    void m_record_load(Entry &entry, std::uint64_t decode_us)
+    {
+        ++m_stats.loads;
+        m_stats.decode_us += decode_us;
+        ++entry.load_count;
+        entry.decode_us = decode_us;
+    }
+
+    // Looks the published pointers up in this instance and up-stream
+    void *m_find_published(ConcurrentSlots ResourcesImpl::*slots, std::uint32_t index) const
+    {
+        for (const ResourcesImpl *node = this; node; node = node->m_parent ? node->m_parent->m_impl : nullptr) {
+            void *pointer = (node->*slots).load(index);
+            if (pointer) {
+                return pointer;
+            }
+        }
+        return nullptr;
+    }
+
+    // Resolves a request in the concurrent mode. The main thread loads the
+    // missing resources as in the regular mode, the other threads load them
+    // outside the lock and then commit them under the lock. The commit may
+    // hand the rest of the load over to the main thread, in which case the
+    // requesting thread waits for it. Either way, the threads requesting a
+    // resource that is being loaded, also asynchronously, wait for it rather
+    // than loading it again.
+    template <class Id, class Get, class Load>
+    void *m_get_concurrently(
+            ConcurrentSlots ResourcesImpl::*slots,
+            Flights &flights,
+            std::map<std::uint32_t, std::shared_ptr<ResourceFutureImpl>> &pending,
+            Id id,
+            Get get,
+            Load load)
+    {
+        void *found = m_find_published(slots, id.index);
+        if (found) {
+            return found;
+        }
+
+        std::unique_lock<std::recursive_mutex> lock { m_mutex };
+        while (true) {
+            m_flights_cv.wait(lock, [&flights, id]() { return !flights.count(id.index); });
+
+            if (std::this_thread::get_id() == m_main_thread) {
+                return get(id, true);
+            }
+
+            found = get(id, false);
+            if (found) {
+                return found;
+            }
+
+            // Should the asynchronous load fail, the resource is loaded here
+            auto it = pending.find(id.index);
+            if (it == end(pending)) {
+                break;
+            }
+            std::shared_ptr<ResourceFutureImpl> future = it->second;
+            lock.unlock();
+            future->await_completion();
+            lock.lock();
+        }
+
+        flights.emplace(id.index, nullptr);
+        lock.unlock();
+
+        std::function<std::shared_ptr<ResourceFutureImpl>()> commit;
+        std::string error;
+        try {
+            commit = load(id);
+        } catch (const Error &e) {
+            error = e.what();
+        }
+
+        lock.lock();
+        auto flight = flights.find(id.index);
+        std::shared_ptr<ResourceFutureImpl> waiter = std::move(flight->second);
+        flights.erase(flight);
+        m_flights_cv.notify_all();
+
+        std::shared_ptr<ResourceFutureImpl> result = error.empty() ? commit() : nullptr;
+        if (waiter) {
+            AsyncLoader::instance().post(waiter);
+        }
+        lock.unlock();
+
+        if (!error.empty()) {
+            throw Error { error };
+        }
+        result->await_completion();
+        if (result->m_state == ResourceFutureImpl::State::FAILED) {
+            throw Error { result->m_error };
+        }
+        return result->m_result;
+    }
+
+    // The future of a resource being loaded by another thread, which the
+    // main thread simply looks up once the flight has landed.
+    template <class Id, class Get>
+    ResourceFuture m_await_flight(Flights::iterator flight, Id id, Get get)
+    {
+        LOG_TRACE("Is being loaded by another thread");
+        if (!flight->second) {
+            flight->second = std::make_shared<ResourceFutureImpl>();
+            flight->second->m_finalize = [this, id, get](ResourceFutureImpl &) -> void* {
+                auto lock = guard();
+                return get(id, true);
+            };
+        }
+        return ResourceFuture { flight->second };
+    }
+
+    // The resources loaded outside of the main thread are created in the
+    // memory, as there is no display to upload them to.
+    template <class Load>
+    static auto m_load_in_memory(Load load) -> decltype(load())
+    {
+        const int flags = al_get_new_bitmap_flags();
+        al_set_new_bitmap_flags(ALLEGRO_MEMORY_BITMAP);
+        try {
+            auto result = load();
+            al_set_new_bitmap_flags(flags);
+            return result;
+        } catch (const Error &) {
+            al_set_new_bitmap_flags(flags);
+            throw;
+        }
+    }
+
+    std::function<std::shared_ptr<ResourceFutureImpl>()> m_load_image_off_main_thread(ImageId id)
+    {
+        Stopwatch stopwatch;
+        const std::string &path = image_registry().key(id.index);
+        ALLEGRO_BITMAP *bitmap = m_load_in_memory([this, &path]() { return m_load_image(path); });
+        const std::uint64_t load_us = stopwatch.microseconds();
+
+        return [this, id, bitmap, load_us]() {
+            const std::size_t bytes = 4 * static_cast<std::size_t>(
+                    al_get_bitmap_width(bitmap) * al_get_bitmap_height(bitmap));
+            ImageEntry &entry = m_set_image(id, bitmap, bytes);
+            if (entry.bitmap.get() == bitmap) {
+                m_record_load(entry, load_us);
+                m_convert_on_main_thread(id, bitmap);
+            }
+            return ResourceFutureImpl::make_ready(static_cast<void*>(entry.bitmap.get()));
+        };
+    }
+
+    // The fonts capture the bitmap flags in effect when they are created,
+    // so only the TrueType file is read here and the font is created on the
+    // main thread as if it were requested asynchronously.
+    std::function<std::shared_ptr<ResourceFutureImpl>()> m_load_font_off_main_thread(FontId id)
+    {
+        Stopwatch stopwatch;
+        const FontKey &key = font_registry().key(id.index);
+        const ArchiveRecord *record;
+        std::shared_ptr<std::vector<char>> data;
+        if (is_font_path(key.first) && !m_find_archived(key.first, ArchiveRecordType::FONT, record)) {
+            data = shared_file_data(m_path_prefix + key.first);
+        }
+        const std::uint64_t load_us = stopwatch.microseconds();
+
+        return [this, id, data, load_us]() {
+            auto future = m_make_font_future(id);
+            future->m_file_data = data;
+            future->m_decode_us = load_us;
+            m_pending_fonts[id.index] = future;
+            AsyncLoader::instance().post(future);
+            return future;
+        };
+    }
+
+    // The memory bitmaps are converted in place, so that the pointers the
+    // other threads have obtained remain valid.
+    void m_convert_on_main_thread(ImageId id, ALLEGRO_BITMAP *bitmap)
+    {
+        auto future = std::make_shared<ResourceFutureImpl>();
+        future->m_finalize = [this, id, bitmap](ResourceFutureImpl &future) -> void* {
+            auto lock = guard();
+            m_pending_conversions.erase(std::find_if(
+                    begin(m_pending_conversions), end(m_pending_conversions),
+                    [&future](const std::shared_ptr<ResourceFutureImpl> &pending) {
+                        return pending.get() == &future;
+                    }));
+            if (id.index < m_images.size() && m_images[id.index].bitmap.get() == bitmap) {
+                al_convert_bitmap(bitmap);
+                LOG_DEBUG("Converted image (%s)", image_registry().key(id.index).c_str());
+            }
+            return static_cast<void*>(bitmap);
+        };
+        m_pending_conversions.push_back(future);
+        AsyncLoader::instance().post(future);
+    }
+
+    void m_publish(ConcurrentSlots &slots, std::uint32_t index, void *pointer)
+    {
+        if (m_concurrent) {
+            slots.store(index, pointer);
+        }
+    }
+
+    void m_dump_own_stats(std::ostream &out, int depth) const
+    {
+        const std::string indent(2 * depth, ' ');
+        const ResourceStats current = stats();
+
+        out << indent << "Resources (" << static_cast<const void*>(this)
+            << ") prefix \"" << m_path_prefix << "\": "
+            << current.hits << " hits, "
+            << current.parent_hits << " parent hits, "
+            << current.misses << " misses, "
+            << current.loads << " loads, "
+            << current.decode_us << " us loading, "
+            << current.bytes_resident << " B resident\n";
+
+        auto dump_entry = [&out, &indent](const std::string &name, const auto &entry, bool resident) {
+            out << indent << "  " << name << ": "
+                << entry.bytes << " B, loaded " << entry.load_count << "x, last load took "
+                << entry.decode_us << " us" << (resident ? "" : " (evicted)") << "\n";
+        };
+
+        for (std::size_t i = 0; i < m_images.size(); ++i) {
+            const ImageEntry &entry = m_images[i];
+            if (entry.load_count) {
+                dump_entry("image " + image_registry().key(i), entry, entry.bitmap != nullptr);
+            }
+        }
+
+        for (std::size_t i = 0; i < m_fonts.size(); ++i) {
+            const FontEntry &entry = m_fonts[i];
+            if (entry.load_count) {
+                const FontKey &key = font_registry().key(i);
+                dump_entry("font " + key.first + " " + std::to_string(key.second),
+                        entry, entry.font != nullptr);
+            }
+        }
+
+        for (const auto &pair : m_image_variants) {
+            const ImageEntry &entry = pair.second.image;
+            dump_entry("image variant " + image_registry().key(std::get<0>(pair.first)),
+                    entry, entry.bitmap != nullptr);
+        }
+
+        for (const auto &pair : m_baked_fonts) {
+            dump_entry("baked font " + std::get<0>(pair.first) + " " + std::to_string(std::get<1>(pair.first)),
+                    pair.second, true);
+        }
+    }
+
+    void m_bump_version()
+    {
+        if (!m_children.empty()) {
+            ++*m_tree_version;
+        }
+    }
+
+    template <class Entry, class Id, class Lookup>
+    Entry *m_find_in_parent(std::vector<ParentCacheEntry<Entry>> &cache, Id id, Lookup lookup)
+    {
+        // The memos can't be trusted while the other threads modify the tree
+        if (m_concurrent) {
+            auto lock = m_parent->m_impl->guard();
+            return lookup(*m_parent->m_impl);
+        }
+
+        const std::uint64_t version = *m_tree_version;
+        if (id.index < cache.size() && cache[id.index].version == version) {
+            LOG_TRACE("Resolved with the parent lookup cache");
+            Entry *entry = cache[id.index].entry;
+            if (entry) {
+                entry->owner->m_touch(*entry);
+                ++entry->owner->m_stats.hits;
+            }
+            return entry;
+        }
+
+        Entry *entry = lookup(*m_parent->m_impl);
+        if (id.index >= cache.size()) {
+            cache.resize(id.index + 1, ParentCacheEntry<Entry> { nullptr, 0 });
+        }
+        cache[id.index] = { entry, version };
+        return entry;
+    }
+
+    ImageEntry &m_set_image(ImageId id, ALLEGRO_BITMAP *bitmap, std::size_t bytes)
+    {
+        return m_set_image(id, std::shared_ptr<ALLEGRO_BITMAP> { bitmap, BitmapDeleter {} }, bytes);
+    }
+
+    ImageEntry &m_set_image(ImageId id, std::shared_ptr<ALLEGRO_BITMAP> bitmap, std::size_t bytes)
+    {
+        if (id.index >= m_images.size()) {
+            m_images.resize(id.index + 1);
+        }
+        ImageEntry &entry = m_images[id.index];
+        if (entry.bitmap) {
+            // The pointer may have been handed out already, so the duplicate
+            // is dropped instead.
+            LOG_WARNING("Image (%s) already resident", image_registry().key(id.index).c_str());
+            return entry;
+        }
+        entry.owner = this;
+        entry.bitmap = std::move(bitmap);
+        entry.bytes = bytes;
+        entry.generation = next_generation();
+        entry.revision = entry.generation;
+        m_list(entry, LruKey { false, id.index });
+        m_publish(m_image_slots, id.index, entry.bitmap.get());
+        m_resident_bytes += bytes;
+        m_bump_version();
+        m_enforce_budget();
+        return entry;
+    }
+
+    FontEntry &m_set_font(
+            FontId id,
+            ALLEGRO_FONT *font,
+            std::shared_ptr<std::vector<char>> data,
+            const void *face,
+            std::size_t bytes)
+    {
+        if (id.index >= m_fonts.size()) {
+            m_fonts.resize(id.index + 1);
+        }
+        FontEntry &entry = m_fonts[id.index];
+        if (entry.font) {
+            LOG_WARNING("Font (%s) already resident", font_registry().key(id.index).first.c_str());
+            FontDeleter {}(font);
+            return entry;
+        }
+        entry.owner = this;
+        entry.font.reset(font);
+        entry.data = std::move(data);
+        entry.face = face;
+        entry.bytes = bytes;
+        entry.generation = next_generation();
+        m_list(entry, LruKey { true, id.index });
+        m_publish(m_font_slots, id.index, entry.font.get());
+        m_charge_font(entry);
+        m_bump_version();
+        m_enforce_budget();
+        return entry;
+    }
+
+    // The data of a face is shared by all its sizes, hence it is charged when
+    // the first size becomes resident and released with the last one.
+    void m_charge_font(const FontEntry &entry)
+    {
+        if (!entry.face || m_face_users[entry.face]++ == 0) {
+            m_resident_bytes += entry.bytes;
+        }
+    }
+
+    void m_release_font(const FontEntry &entry)
+    {
+        if (entry.face) {
+            auto it = m_face_users.find(entry.face);
+            if (--it->second > 0) {
+                return;
+            }
+            m_face_users.erase(it);
+        }
+        m_resident_bytes -= entry.bytes;
+    }
+
+    // Evicts the least recently used resources until the budget is met. The
+    // most recently used resource is never evicted so that the pointer that
+    // is about to be returned remains valid. The packed images and the atlas
+    // pages don't count as the atlas space can't be reclaimed.
+    void m_enforce_budget()
+    {
+        while (m_memory_budget && m_resident_bytes > m_memory_budget) {
+            if (m_lru.size() < 2) {
+                LOG_WARNING("Memory budget exceeded with nothing left to evict");
+                return;
+            }
+
+            m_bump_version();
+
+            const LruKey key = m_lru.front();
+            if (key.is_font) {
+                FontEntry &entry = m_fonts[key.index];
+                LOG_DEBUG("Evicting font (%p)", entry.font.get());
+                m_unlist(entry);
+                m_release_font(entry);
+                entry.font.reset();
+                entry.data.reset();
+            } else {
+                ImageEntry &entry = m_images[key.index];
+                LOG_DEBUG("Evicting image (%p)", entry.bitmap.get());
+                m_unlist(entry);
+                m_resident_bytes -= entry.bytes;
+                entry.bitmap.reset();
+            }
+        }
+    }
+
+    // The archives mounted up-stream are used as well; the latest mounted
+    // archive takes precedence.
+    const AssetArchive *m_find_archived(
+            const std::string &path,
+            ArchiveRecordType type,
+            const ArchiveRecord *&record) const
+    {
+        for (auto it = m_archives.rbegin(); it != m_archives.rend(); ++it) {
+            if ((record = (*it)->find(path, type))) {
+                return it->get();
+            }
+        }
+        return m_parent ? m_parent->m_impl->m_find_archived(path, type, record) : nullptr;
+    }
+
+    ALLEGRO_BITMAP *m_load_image(const std::string &path)
+    {
+        const ArchiveRecord *record;
+        const AssetArchive *archive = m_find_archived(path, ArchiveRecordType::IMAGE, record);
+        if (archive) {
+            return archive->create_image(*record, path);
+        }
+
+        std::string full_path = m_path_prefix + path;
+        ALLEGRO_BITMAP *bitmap = al_load_bitmap(full_path.c_str());
+        if (!bitmap) {
+            throw Error { std::string { "Failed loading image " } + full_path };
+        }
+        LOG_DEBUG("Loaded image (%s)", full_path.c_str());
+        return bitmap;
+    }
+
+    // Takes ownership of a freshly loaded image and stores it in the atlas
+    // if eligible, otherwise it is only converted to the current display's
+    // format, which is a no-op for the images loaded on the main thread.
+    ALLEGRO_BITMAP *m_store_image(ImageId id, ALLEGRO_BITMAP *bitmap)
+    {
+        std::unique_ptr<ALLEGRO_BITMAP, BitmapDeleter> loaded { bitmap };
+
+        if (id.index < m_images.size() && m_images[id.index].bitmap) {
+            LOG_WARNING("Image (%s) already resident", image_registry().key(id.index).c_str());
+            return m_images[id.index].bitmap.get();
+        }
+
+        if (al_get_bitmap_width(bitmap) <= m_atlas_max_image_size &&
+            al_get_bitmap_height(bitmap) <= m_atlas_max_image_size) {
+            ALLEGRO_BITMAP *packed = nullptr;
+            for (auto &page : m_atlas_pages) {
+                if ((packed = page->insert(bitmap))) {
+                    break;
+                }
+            }
+            if (!packed) {
+                m_atlas_pages.emplace_back(new AtlasPage { m_atlas_page_size });
+                m_atlas_bytes += 4 * static_cast<std::size_t>(m_atlas_page_size * m_atlas_page_size);
+                packed = m_atlas_pages.back()->insert(bitmap);
+            }
+            if (packed) {
+                LOG_DEBUG("Packed image (%s) into atlas page %d",
+                        image_registry().key(id.index).c_str(),
+                        static_cast<int>(m_atlas_pages.size()) - 1);
+                m_set_image(id, packed, 0);
+                return packed;
+            }
+        }
+
+        al_convert_bitmap(bitmap);
+        std::size_t bytes = 4 * static_cast<std::size_t>(
+                al_get_bitmap_width(bitmap) * al_get_bitmap_height(bitmap));
+        m_set_image(id, loaded.release(), bytes);
+        return bitmap;
+    }
+
+    // Stores the image shared through the process-wide store. The image is
+    // only decoded, unless already provided, if no other instance holds it.
+    // The shared images are never packed into the atlas and their size is
+    // accounted for in every instance that holds them.
+    ALLEGRO_BITMAP *m_store_shared_image(
+            ImageId id,
+            const std::string &full_path,
+            const std::vector<char> &data,
+            const SharedImageStore::Key &key,
+            ALLEGRO_BITMAP *decoded)
+    {
+        std::unique_ptr<ALLEGRO_BITMAP, BitmapDeleter> loaded { decoded };
+        SharedImageStore &store = SharedImageStore::instance();
+
+        std::shared_ptr<ALLEGRO_BITMAP> bitmap = store.find(key);
+        if (bitmap) {
+            LOG_DEBUG("Reusing shared image (%s)", full_path.c_str());
+        } else {
+            if (!loaded) {
+                loaded.reset(decode_image(data, full_path));
+            }
+            if (!loaded) {
+                throw Error { std::string { "Failed loading image " } + full_path };
+            }
+            al_convert_bitmap(loaded.get());
+            bitmap.reset(loaded.release(), BitmapDeleter {});
+            store.insert(key, bitmap);
+            LOG_DEBUG("Loaded shared image (%s)", full_path.c_str());
+        }
+
+        std::size_t bytes = 4 * static_cast<std::size_t>(
+                al_get_bitmap_width(bitmap.get()) * al_get_bitmap_height(bitmap.get()));
+        return m_set_image(id, std::move(bitmap), bytes).bitmap.get();
+    }
+
+    // Loads the image through the process-wide store unless the sharing is
+    // disabled or the image is archived, in which case it is already in
+    // memory anyway. Tells whether the image has been loaded.
+    bool m_load_shared_image(ImageId id, const std::string &path)
+    {
+        const ArchiveRecord *record;
+        if (!m_share_images || m_find_archived(path, ArchiveRecordType::IMAGE, record)) {
+            return false;
+        }
+
+        std::string full_path = m_path_prefix + path;
+        auto data = read_file(full_path);
+        m_store_shared_image(id, full_path, *data, SharedImageStore::key(*data), nullptr);
+        return true;
+    }
+
+    void m_watch_image(ImageId id)
+    {
+        const std::string &path = image_registry().key(id.index);
+        const ArchiveRecord *record;
+        if (m_watcher && !m_find_archived(path, ArchiveRecordType::IMAGE, record)) {
+            m_watcher->watch(m_path_prefix + path, id.index);
+        }
+    }
+
+    // Called on the watcher thread. The changed image is decoded in the
+    // background and swapped on the main thread while processing the loads.
+    void m_reload_image(std::uint32_t index, const std::string &full_path)
+    {
+        std::lock_guard<std::mutex> lock { m_reload_mutex };
+        if (m_pending_reloads.count(index)) {
+            return;
+        }
+
+        auto future = std::make_shared<ResourceFutureImpl>();
+        future->m_finalize = [this, index, full_path](ResourceFutureImpl &future) -> void* {
+            auto lock = guard();
+            {
+                std::lock_guard<std::mutex> lock { m_reload_mutex };
+                m_pending_reloads.erase(index);
+            }
+            if (!future.m_error.empty()) {
+                LOG_WARNING("Failed reloading image (%s)", full_path.c_str());
+                throw Error { future.m_error };
+            }
+            return static_cast<void*>(m_swap_image(ImageId { index }, future.m_bitmap.release()));
+        };
+
+        AsyncLoader::instance().decode(future, [full_path](ResourceFutureImpl &future) {
+            al_set_new_bitmap_flags(ALLEGRO_MEMORY_BITMAP);
+            future.m_bitmap.reset(al_load_bitmap(full_path.c_str()));
+            if (!future.m_bitmap) {
+                throw Error { std::string { "Failed loading image " } + full_path };
+            }
+        });
+
+        m_pending_reloads[index] = future;
+    }
+
+    // Replaces the contents of a stored image with the reloaded one. If the
+    // size hasn't changed and the image isn't shared with other instances,
+    // the pixels are copied in place and the pointers remain valid.
+    // Otherwise the image is stored anew and the handles are invalidated.
+    ALLEGRO_BITMAP *m_swap_image(ImageId id, ALLEGRO_BITMAP *reloaded)
+    {
+        std::unique_ptr<ALLEGRO_BITMAP, BitmapDeleter> loaded { reloaded };
+
+        if (id.index >= m_images.size() || !m_images[id.index].bitmap) {
+            LOG_DEBUG("Reloaded image not resident (%s)", image_registry().key(id.index).c_str());
+            return nullptr;
+        }
+
+        ImageEntry &entry = m_images[id.index];
+        ALLEGRO_BITMAP *bitmap = entry.bitmap.get();
+
+        if (entry.bitmap.use_count() == 1 &&
+            al_get_bitmap_width(bitmap) == al_get_bitmap_width(reloaded) &&
+            al_get_bitmap_height(bitmap) == al_get_bitmap_height(reloaded)) {
+            SharedImageStore::instance().forget(bitmap);
+            ALLEGRO_STATE state;
+            al_store_state(&state, ALLEGRO_STATE_TARGET_BITMAP | ALLEGRO_STATE_BLENDER);
+            al_set_target_bitmap(bitmap);
+            al_set_blender(ALLEGRO_ADD, ALLEGRO_ONE, ALLEGRO_ZERO);
+            al_draw_bitmap(reloaded, 0, 0, 0);
+            al_restore_state(&state);
+            entry.revision = next_generation();
+            LOG_DEBUG("Reloaded image in place (%s)", image_registry().key(id.index).c_str());
+            return bitmap;
+        }
+
+        m_unlist(entry);
+        m_resident_bytes -= entry.bytes;
+        entry.bitmap.reset();
+        LOG_DEBUG("Reloaded image (%s)", image_registry().key(id.index).c_str());
+        return m_store_image(id, loaded.release());
+    }
+
+    // The TrueType fonts are created from the file data shared between all
+    // the sizes of the given face, which is read unless already provided.
+    // The font must not outlive the data.
+    ALLEGRO_FONT *m_load_font(
+            const std::string &path,
+            int size,
+            std::shared_ptr<std::vector<char>> &data)
+    {
+        const ArchiveRecord *record;
+        const AssetArchive *archive = m_find_archived(path, ArchiveRecordType::FONT, record);
+        if (archive) {
+            return archive->create_font(*record, path, size);
+        }
+
+        std::string full_path = m_path_prefix + path;
+        if (is_font_path(path)) {
+            if (!data) {
+                data = shared_file_data(full_path);
+            }
+            return m_load_font_from_memory(path, size, *data);
+        }
+
+        ALLEGRO_FONT *font = al_load_font(full_path.c_str(), -size, 0);
+        if (!font) {
+            throw Error { std::string { "Failed loading font " } + full_path };
+        }
+        LOG_DEBUG("Loaded font (%s)", full_path.c_str());
+        return font;
+    }
+
+    // Also identifies the face the data belongs to; the fonts loaded from
+    // separate files have none.
+    std::size_t m_font_bytes(
+            const std::string &path,
+            const std::shared_ptr<std::vector<char>> &data,
+            const void *&face) const
+    {
+        if (data) {
+            face = data.get();
+            return data->size();
+        }
+        const ArchiveRecord *record;
+        if (m_find_archived(path, ArchiveRecordType::FONT, record)) {
+            face = record;
+            return record->size;
+        }
+        face = nullptr;
+        return file_size(m_path_prefix + path);
+    }
+
+    ALLEGRO_FONT *m_load_font_from_memory(const std::string &path, int size, std::vector<char> &data)
+    {
+        std::string full_path = m_path_prefix + path;
+        ALLEGRO_FILE *file = al_open_memfile(data.data(), data.size(), "r");
+        if (!file) {
+            throw Error { std::string { "Failed opening font data " } + full_path };
+        }
+
+        // The file is owned by the font from now on, also in case of failure
+        ALLEGRO_FONT *font = al_load_ttf_font_f(file, full_path.c_str(), -size, 0);
+        if (!font) {
+            throw Error { std::string { "Failed loading font " } + full_path };
+        }
+        LOG_DEBUG("Loaded font from memory (%s)", full_path.c_str());
+        return font;
+    }
+
+    const std::string &m_find_glyph_cache_dir() const
+    {
+        if (m_glyph_cache_dir.empty() && m_parent) {
+            return m_parent->m_impl->m_find_glyph_cache_dir();
+        }
+        return m_glyph_cache_dir;
+    }
+
+    // The baked glyphs are laid out in a grid of cells separated with lines
+    // of the background color as expected by al_grab_font_from_bitmap(). Each
+    // cell is as wide as the glyph's advance and as high as the face's line,
+    // so the text laid out with the baked font matches the original except
+    // for the kerning. The glyphs are clipped to their cells, as the parts
+    // overhanging the advance (e.g. of italics) would break the separators.
+    ALLEGRO_BITMAP *m_render_glyphs(ALLEGRO_FONT *font, int first_char, int last_char)
+    {
+        static const int atlas_width = 1024;
+        const int line_height = al_get_font_line_height(font);
+
+        std::vector<std::pair<int, int>> cells;
+        int x = 1, y = 1;
+        for (int c = first_char; c <= last_char; ++c) {
+            int width = std::max(1, al_get_glyph_advance(font, c, ALLEGRO_NO_KERNING));
+            if (x + width + 1 > atlas_width) {
+                x = 1;
+                y += line_height + 1;
+            }
+            cells.emplace_back(x, width);
+            x += width + 1;
+        }
+        const int atlas_height = y + line_height + 1;
+
+        ALLEGRO_BITMAP *atlas = al_create_bitmap(atlas_width, atlas_height);
+        if (!atlas) {
+            throw Error { "Failed creating glyph atlas" };
+        }
+
+        ALLEGRO_STATE state;
+        al_store_state(&state, ALLEGRO_STATE_TARGET_BITMAP | ALLEGRO_STATE_BLENDER);
+        al_set_target_bitmap(atlas);
+        al_clear_to_color(al_map_rgb(255, 0, 255));
+
+        y = 1;
+        for (int c = first_char; c <= last_char; ++c) {
+            const std::pair<int, int> &cell = cells[c - first_char];
+            if (cell.first == 1 && c != first_char) {
+                y += line_height + 1;
+            }
+            al_set_blender(ALLEGRO_ADD, ALLEGRO_ONE, ALLEGRO_ZERO);
+            al_draw_filled_rectangle(
+                    cell.first, y,
+                    cell.first + cell.second, y + line_height,
+                    al_map_rgba(0, 0, 0, 0));
+            al_set_blender(ALLEGRO_ADD, ALLEGRO_ONE, ALLEGRO_INVERSE_ALPHA);
+            al_set_clipping_rectangle(cell.first, y, cell.second, line_height);
+            al_draw_glyph(font, al_map_rgb(255, 255, 255), cell.first, y, c);
+        }
+
+        al_reset_clipping_rectangle();
+        al_restore_state(&state);
+        return atlas;
+    }
+
+    ALLEGRO_FONT *m_bake_font(const std::string &path, int size, int first_char, int last_char)
+    {
+        std::string full_path = m_path_prefix + path;
+        std::shared_ptr<std::vector<char>> data = shared_file_data(full_path);
+        const int ranges[] = { first_char, last_char };
+
+        // The cached files are keyed with the font contents' hash
+        std::string cache_base;
+        const std::string &cache_dir = m_find_glyph_cache_dir();
+        if (!cache_dir.empty()) {
+            std::stringstream ss;
+            ss << cache_dir << "/" << std::hex << hash_bytes(data->data(), data->size())
+               << std::dec << "-" << size << "-" << first_char << "-" << last_char;
+            cache_base = ss.str();
+        }
+
+        std::string metrics_header;
+        {
+            std::stringstream ss;
+            ss << "dick-glyphs 2 " << size << " " << first_char << " " << last_char;
+            metrics_header = ss.str();
+        }
+
+        // The cached atlas is only used if its line height matches the one
+        // recorded along with it, which tells a corrupt or foreign atlas.
+        if (!cache_base.empty()) {
+            std::ifstream metrics { cache_base + ".txt" };
+            std::string header, name;
+            int line_height = 0;
+            if (metrics && std::getline(metrics, header) && header == metrics_header &&
+                    metrics >> name >> line_height && name == "line_height") {
+                // The atlas has been saved with the alpha premultiplied already
+                std::unique_ptr<ALLEGRO_BITMAP, BitmapDeleter> atlas {
+                    al_load_bitmap_flags((cache_base + ".png").c_str(), ALLEGRO_NO_PREMULTIPLIED_ALPHA)
+                };
+                if (atlas) {
+                    std::unique_ptr<ALLEGRO_FONT, FontDeleter> font {
+                        al_grab_font_from_bitmap(atlas.get(), 1, ranges)
+                    };
+                    if (font && al_get_font_line_height(font.get()) == line_height) {
+                        LOG_DEBUG("Loaded baked font (%s) from the glyph cache", full_path.c_str());
+                        return font.release();
+                    }
+                }
+            }
+            LOG_DEBUG("Glyph cache miss for (%s)", full_path.c_str());
+        }
+
+        std::unique_ptr<ALLEGRO_FONT, FontDeleter> ttf { m_load_font_from_memory(path, size, *data) };
+        std::unique_ptr<ALLEGRO_BITMAP, BitmapDeleter> atlas {
+            m_render_glyphs(ttf.get(), first_char, last_char)
+        };
+
+        ALLEGRO_FONT *font = al_grab_font_from_bitmap(atlas.get(), 1, ranges);
+        if (!font) {
+            throw Error { std::string { "Failed baking font " } + full_path };
+        }
+        LOG_DEBUG("Baked font (%s)", full_path.c_str());
+
+        if (!cache_base.empty()) {
+            al_make_directory(cache_dir.c_str());
+            std::ofstream metrics { cache_base + ".txt" };
+            metrics << metrics_header << "\n"
+                    << "line_height " << al_get_font_line_height(font) << "\n";
+            if (!al_save_bitmap((cache_base + ".png").c_str(), atlas.get()) || !metrics) {
+                LOG_WARNING("Failed storing baked font in the glyph cache (%s)", cache_base.c_str());
+            }
+        }
+
+        return font;
+    }
+
+public:
+    ResourcesImpl(const std::string &path_prefix, Resources *parent) :
+        m_parent { parent },
+        m_path_prefix { path_prefix },
+        m_atlas_page_size { 0 },
+        m_atlas_max_image_size { 0 },
+        m_share_images { false },
+        m_tree_version {
+            parent ?
+                parent->m_impl->m_tree_version :
+                std::make_shared<std::atomic<std::uint64_t>>(1)
+        },
+        m_stats {},
+        m_concurrent { parent && parent->m_impl->m_concurrent },
+        m_main_thread { parent ? parent->m_impl->m_main_thread : std::thread::id {} },
+        m_memory_budget { 0 },
+        m_resident_bytes { 0 },
+        m_atlas_bytes { 0 }
+    {
+        if (m_parent) {
+            auto lock = m_parent->m_impl->guard();
+            m_parent->m_impl->m_children.push_back(this);
+        }
+    }
+
+    ~ResourcesImpl()
+    {
+        m_watcher.reset();
+        for (auto &pair : m_pending_reloads) {
+            pair.second->m_finalize = nullptr;
+        }
+
+        for (auto &future : m_pending_conversions) {
+            future->m_finalize = nullptr;
+        }
+
+        if (m_parent) {
+            auto lock = m_parent->m_impl->guard();
+            auto &siblings = m_parent->m_impl->m_children;
+            siblings.erase(std::find(begin(siblings), end(siblings), this));
+        }
+
+        for (auto &pair : m_pending_images) {
+            pair.second->m_finalize = nullptr;
+        }
+        for (auto &pair : m_pending_fonts) {
+            pair.second->m_finalize = nullptr;
+        }
+        for (Flights *flights : { &m_image_flights, &m_font_flights }) {
+            for (auto &pair : *flights) {
+                if (pair.second) {
+                    pair.second->m_finalize = nullptr;
+                }
+            }
+        }
+    }
+
+    ImageEntry *get_image_entry(ImageId id, bool can_store)
+    {
+        LOG_TRACE("Getting image (%s)", image_registry().key(id.index).c_str());
+
+        ImageEntry *found = m_find_image(id);
+        if (found) {
+            LOG_TRACE("Found in this instance");
+            ++m_stats.hits;
+            return found;
+        }
+
+        if (m_parent) {
+            LOG_TRACE("Didn't find in this instance; parent exists, checking...");
+            ImageEntry *parent_result = m_find_in_parent(m_parent_images, id,
+                [id](ResourcesImpl &parent) { return parent.get_image_entry(id, false); });
+            if (parent_result) {
+                LOG_TRACE("...found in parent");
+                if (can_store) {
+                    ++m_stats.parent_hits;
+                }
+                return parent_result;
+            } else {
+                LOG_TRACE("...didn't find in parent");
+            }
+        }
+
+        if (can_store) {
+            ++m_stats.misses;
+            auto pending = m_pending_images.find(id.index);
+            if (pending != end(m_pending_images)) {
+                LOG_TRACE("Is being loaded asynchronously, waiting...");
+                ResourceFuture { pending->second }.get();
+                return m_find_image(id);
+            }
+
+            LOG_TRACE("Is allowed to store resources, trying to load...");
+            const std::string &path = image_registry().key(id.index);
+            Stopwatch stopwatch;
+            if (!m_load_shared_image(id, path)) {
+                m_store_image(id, m_load_image(path));
+            }
+            m_watch_image(id);
+            LOG_TRACE("...SUCCESS");
+            m_record_load(m_images[id.index], stopwatch.microseconds());
+            return &m_images[id.index];
+        } else {
+            LOG_TRACE("Isn't allowed to store resources, report failure");
+            return nullptr;
+        }
+    }
+
+    ALLEGRO_SAMPLE *get_sample(const std::string &path, bool can_store)
+    {
+        LOG_TRACE("Getting sample (%s)", path.c_str());
+
+        auto found = m_samples.find(path);
+        if (found != end(m_samples)) {
+            LOG_TRACE("Found in this instance");
+            return found->second.get();
+        }
+
+        if (m_parent) {
+            LOG_TRACE("Didn't find in this instance; parent exists, checking...");
+            ALLEGRO_SAMPLE *parent_result = m_parent->m_impl->get_sample(path, false);
+            if (parent_result) {
+                LOG_TRACE("...found in parent");
+                return parent_result;
+            } else {
+                LOG_TRACE("...didn't find in parent");
+            }
+        }
+
+        if (can_store) {
+            LOG_TRACE("Is allowed to store resources, trying to load...");
+            std::string full_path = m_path_prefix + path;
+            ALLEGRO_SAMPLE *sample = al_load_sample(full_path.c_str());
+            if (!sample) {
+                throw Error { std::string { "Failed loading sample " } + full_path };
+            }
+            LOG_TRACE("...SUCCESS");
+            m_samples[path].reset(sample);
+            return sample;
+        } else {
+            LOG_TRACE("Isn't allowed to store resources, report failure");
+            return nullptr;
+        }
+    }
+
+    AudioStream open_stream(const std::string &path, int buffer_count, int buffer_samples)
+    {
+        return AudioStream {
+            std::make_shared<AudioStreamImpl>(m_path_prefix + path, buffer_count, buffer_samples)
+        };
+    }
+
+    FontEntry *get_font_entry(FontId id, bool can_store)
+    {
+        LOG_TRACE("Getting font (%s)", font_registry().key(id.index).first.c_str());
+
+        FontEntry *found = m_find_font(id);
+        if (found) {
+            LOG_TRACE("Found in this instance");
+            ++m_stats.hits;
+            return found;
+        }
+
+        if (m_parent) {
+            LOG_TRACE("Didn't find in this instance; parent exists, checking...");
+            FontEntry *parent_result = m_find_in_parent(m_parent_fonts, id,
+                [id](ResourcesImpl &parent) { return parent.get_font_entry(id, false); });
+            if (parent_result) {
+                LOG_TRACE("...found in parent");
+                if (can_store) {
+                    ++m_stats.parent_hits;
+                }
+                return parent_result;
+            } else {
+                LOG_TRACE("...didn't find in parent");
+            }
+        }
+
+        if (can_store) {
+            ++m_stats.misses;
+            auto pending = m_pending_fonts.find(id.index);
+            if (pending != end(m_pending_fonts)) {
+                LOG_TRACE("Is being loaded asynchronously, waiting...");
+                ResourceFuture { pending->second }.get();
+                return m_find_font(id);
+            }
+
+            LOG_TRACE("Is allowed to store resources, trying to load...");
+            const FontKey &key = font_registry().key(id.index);
+            std::shared_ptr<std::vector<char>> data;
+            Stopwatch stopwatch;
+            ALLEGRO_FONT *font = m_load_font(key.first, key.second, data);
+            LOG_TRACE("...SUCCESS");
+            const void *face;
+            std::size_t bytes = m_font_bytes(key.first, data, face);
+            FontEntry &entry = m_set_font(id, font, data, face, bytes);
+            m_record_load(entry, stopwatch.microseconds());
+            return &entry;
+        } else {
+            LOG_TRACE("Isn't allowed to store resources, report failure");
+            return nullptr;
+        }
+    }
+
+    void *get_image(ImageId id, bool can_store)
+    {
+        ImageEntry *entry = get_image_entry(id, can_store);
+        return entry ? static_cast<void*>(entry->bitmap.get()) : nullptr;
+    }
+
+    void *get_font(FontId id, bool can_store)
+    {
+        FontEntry *entry = get_font_entry(id, can_store);
+        return entry ? static_cast<void*>(entry->font.get()) : nullptr;
+    }
+
+    ImageHandle get_image_handle(ImageId id)
+    {
+        ImageEntry *entry = get_image_entry(id, true);
+        return { id, entry->generation, static_cast<void*>(entry->bitmap.get()) };
+    }
+
+    FontHandle get_font_handle(FontId id)
+    {
+        FontEntry *entry = get_font_entry(id, true);
+        return { id, entry->generation, static_cast<void*>(entry->font.get()) };
+    }
+
+    bool is_valid(const ImageHandle &handle)
+    {
+        const ImageEntry *entry = m_peek_image(handle.id);
+        return entry && entry->generation == handle.generation;
+    }
+
+    bool is_valid(const FontHandle &handle)
+    {
+        const FontEntry *entry = m_peek_font(handle.id);
+        return entry && entry->generation == handle.generation;
+    }
+
+    ResourceFuture preload(const ResourceManifest &manifest, ProgressCallback progress)
+    {
+        LOG_DEBUG("Preloading %d images and %d fonts",
+                static_cast<int>(manifest.images.size()),
+                static_cast<int>(manifest.fonts.size()));
+
+        // Requesting all the resources up front lets the worker threads
+        // decode them in parallel.
+        auto group = std::make_shared<ResourceFutureImpl>();
+        for (const std::string &path : manifest.images) {
+            group->m_members.push_back(get_image_async(intern_image(path)).m_impl);
+        }
+        for (const auto &font : manifest.fonts) {
+            group->m_members.push_back(get_font_async(intern_font(font.first, font.second)).m_impl);
+        }
+
+        const int total = group->m_members.size();
+        if (total == 0) {
+            group->complete(nullptr, {});
+            return ResourceFuture { group };
+        }
+
+        // The group is only referenced weakly by the observers as it holds
+        // the members, which hold the observers.
+        struct Progress {
+            int loaded;
+            std::string error;
+        };
+        auto state = std::make_shared<Progress>(Progress { 0, {} });
+        std::weak_ptr<ResourceFutureImpl> weak_group = group;
+
+        for (auto &member : group->m_members) {
+            member->observe([state, total, progress, weak_group](ResourceFutureImpl &member) {
+                ++state->loaded;
+                if (state->error.empty()) {
+                    state->error = member.m_error;
+                }
+                if (progress) {
+                    progress(state->loaded, total);
+                }
+                auto group = weak_group.lock();
+                if (group && state->loaded == total) {
+                    group->complete(nullptr, state->error);
+                }
+            });
+        }
+
+        return ResourceFuture { group };
+    }
+
+    void *get_image_variant(ImageId id, double scale, const Color &tint, int flags)
+    {
+        if (!(scale > 0.0)) {
+            throw Error { "Invalid image variant scale" };
+        }
+
+        const ImageEntry *source = get_image_entry(id, true);
+        const VariantKey key { id.index, scale, tint.r, tint.g, tint.b, flags };
+        auto found = m_image_variants.find(key);
+        if (found != end(m_image_variants) && found->second.source_revision == source->revision) {
+            return static_cast<void*>(found->second.image.bitmap.get());
+        }
+
+        Stopwatch stopwatch;
+        PixelBuffer pixels = read_pixels(source->bitmap.get());
+        const int width = std::max(1, static_cast<int>(pixels.width * scale + 0.5));
+        const int height = std::max(1, static_cast<int>(pixels.height * scale + 0.5));
+        while (pixels.width / 2 >= width && pixels.height / 2 >= height) {
+            pixels = halve_pixels(pixels);
+        }
+        ALLEGRO_BITMAP *bitmap = create_bitmap(resample_pixels(pixels, width, height, tint, flags));
+
+        VariantEntry &variant = m_image_variants[key];
+        ImageEntry &entry = variant.image;
+        entry.owner = this;
+        entry.bitmap.reset(bitmap, BitmapDeleter {});
+        entry.bytes = 4 * static_cast<std::size_t>(width * height);
+        entry.generation = next_generation();
+        entry.revision = entry.generation;
+        variant.source_revision = source->revision;
+        m_record_load(entry, stopwatch.microseconds());
+
+        LOG_DEBUG("Created image variant (%s) of %dx%d",
+                image_registry().key(id.index).c_str(), width, height);
+        return static_cast<void*>(bitmap);
+    }
+
+    ResourceStats stats() const
+    {
+        ResourceStats result = m_stats;
+        result.bytes_resident = m_resident_bytes + m_atlas_bytes;
+        return result;
+    }
+
+    void dump_stats(std::ostream &out, int depth)
+    {
+        std::vector<ResourcesImpl*> children;
+        {
+            auto lock = guard();
+            m_dump_own_stats(out, depth);
+            children = m_children;
+        }
+
+        // The children are locked after the parent is released, as they lock
+        // the parent while holding their own locks.
+        for (ResourcesImpl *child : children) {
+            child->dump_stats(out, depth + 1);
+        }
+    }
+
+    void set_glyph_cache_dir(const std::string &path)
+    {
+        m_glyph_cache_dir = path;
+    }
+
+    FontEntry *find_baked_font(const BakedFontKey &key)
+    {
+        auto it = m_baked_fonts.find(key);
+        if (it != end(m_baked_fonts)) {
+            return &it->second;
+        }
+        return m_parent ? m_parent->m_impl->find_baked_font(key) : nullptr;
+    }
+
+    void *get_font_baked(const std::string &path, int size, int first_char, int last_char)
+    {
+        LOG_TRACE("Getting baked font (%s)", path.c_str());
+
+        BakedFontKey key { path, size, first_char, last_char };
+        FontEntry *found = find_baked_font(key);
+        if (found) {
+            return static_cast<void*>(found->font.get());
+        }
+
+        Stopwatch stopwatch;
+        ALLEGRO_FONT *font = m_bake_font(path, size, first_char, last_char);
+        FontEntry &entry = m_baked_fonts[key];
+        entry.owner = this;
+        entry.font.reset(font);
+        entry.face = nullptr;
+        entry.bytes = 0;
+        entry.generation = next_generation();
+        m_record_load(entry, stopwatch.microseconds());
+        return static_cast<void*>(entry.font.get());
+    }
+
+    void mount_archive(const std::string &path)
+    {
+        m_archives.push_back(std::make_shared<AssetArchive>(m_path_prefix + path));
+    }
+
+    std::unique_lock<std::recursive_mutex> guard()
+    {
+        return m_concurrent ?
+            std::unique_lock<std::recursive_mutex> { m_mutex } :
+            std::unique_lock<std::recursive_mutex> {};
+    }
+
+    // The eviction and the hot reload would invalidate or overwrite the
+    // images held by the other threads at any time, hence neither a budget
+    // nor watching in the concurrent mode.
+    void enable_concurrency()
+    {
+        std::vector<ResourcesImpl*> path;
+        for (ResourcesImpl *node = this; node; node = node->m_parent ? node->m_parent->m_impl : nullptr) {
+            path.push_back(node);
+        }
+
+        for (ResourcesImpl *node : path) {
+            if (node->m_memory_budget) {
+                throw Error { "The concurrent mode can't be used with a memory budget" };
+            }
+            if (node->m_watcher) {
+                throw Error { "The concurrent mode can't be used with watching" };
+            }
+        }
+
+        for (ResourcesImpl *node : path) {
+            if (node->m_concurrent) {
+                continue;
+            }
+            node->m_concurrent = true;
+            node->m_main_thread = std::this_thread::get_id();
+            for (std::uint32_t i = 0; i < node->m_images.size(); ++i) {
+                node->m_publish(node->m_image_slots, i, node->m_images[i].bitmap.get());
+            }
+            for (std::uint32_t i = 0; i < node->m_fonts.size(); ++i) {
+                node->m_publish(node->m_font_slots, i, node->m_fonts[i].font.get());
+            }
+        }
+    }
+
+    void *concurrent_get_image(ImageId id)
+    {
+        return m_get_concurrently(
+                &ResourcesImpl::m_image_slots, m_image_flights, m_pending_images, id,
+                [this](ImageId id, bool can_store) { return get_image(id, can_store); },
+                [this](ImageId id) { return m_load_image_off_main_thread(id); });
+    }
+
+    void *concurrent_get_font(FontId id)
+    {
+        return m_get_concurrently(
+                &ResourcesImpl::m_font_slots, m_font_flights, m_pending_fonts, id,
+                [this](FontId id, bool can_store) { return get_font(id, can_store); },
+                [this](FontId id) { return m_load_font_off_main_thread(id); });
+    }
+
+    bool is_concurrent() const { return m_concurrent; }
+
+    void set_memory_budget(std::size_t bytes)
+    {
+        if (m_concurrent && bytes) {
+            throw Error { "The memory budget can't be used in the concurrent mode" };
+        }
+        m_memory_budget = bytes;
+        m_enforce_budget();
+    }
+
+    TiledImage open_tiled_image(const std::string &path, int tile_size, int max_tiles)
+    {
+        auto image = std::make_shared<TiledImageImpl>(path, tile_size, max_tiles);
+
+        const ArchiveRecord *record;
+        const AssetArchive *archive = m_find_archived(path, ArchiveRecordType::IMAGE, record);
+        if (archive) {
+            image->set_source(archive->shared_from_this(), archive->data(*record), record->width, record->height);
+        } else {
+            LOG_WARNING("Tiled image (%s) isn't archived; decoding it whole", path.c_str());
+            image->load_source(m_path_prefix + path);
+        }
+
+        return TiledImage { image };
+    }
+
+    void enable_watch()
+    {
+        if (m_concurrent) {
+            throw Error { "Watching can't be used in the concurrent mode" };
+        }
+        if (m_watcher) {
+            return;
+        }
+
+        m_watcher.reset(new FileWatcher {
+            [this](std::uint32_t index, const std::string &full_path) {
+                m_reload_image(index, full_path);
+            }
+        });
+
+        for (std::uint32_t i = 0; i < m_images.size(); ++i) {
+            if (m_images[i].bitmap) {
+                m_watch_image(ImageId { i });
+            }
+        }
+    }
+
+    void enable_image_sharing()
+    {
+        m_share_images = true;
+    }
+
+    void enable_atlas(int page_size, int max_image_size)
+    {
+        if (max_image_size > page_size - 1) {
+            throw Error { "Atlas image size limit exceeds the page size" };
+        }
+        m_atlas_page_size = page_size;
+        m_atlas_max_image_size = max_image_size;
+    }
+
+    ResourceFuture get_image_async(ImageId id)
+    {
+        const std::string &path = image_registry().key(id.index);
+        LOG_TRACE("Getting image asynchronously (%s)", path.c_str());
+
+        void *available = get_image(id, false);
+        if (available) {
+            return ResourceFuture { ResourceFutureImpl::make_ready(available) };
+        }
+
+        // There is nothing to decode in the archived images
+        const ArchiveRecord *record;
+        if (m_find_archived(path, ArchiveRecordType::IMAGE, record)) {
+            return ResourceFuture { ResourceFutureImpl::make_ready(get_image(id, true)) };
+        }
+
+        auto pending = m_pending_images.find(id.index);
+        if (pending != end(m_pending_images)) {
+            LOG_TRACE("Already being loaded");
+            return ResourceFuture { pending->second };
+        }
 
-        auto it = m_images.find(path);
-        if (it != end(m_images)) {
-            LOG_TRACE("Found in this instance");
-            return static_cast<void*>(it->second.get());
+        auto flight = m_image_flights.find(id.index);
+        if (flight != end(m_image_flights)) {
+            return m_await_flight(flight, id,
+                [this](ImageId id, bool can_store) { return get_image(id, can_store); });
         }
 
-        if (m_parent) {
-            LOG_TRACE("Didn't find in this instance; parent exists, checking...");
-            void *parent_result = m_parent->m_impl->get_image(path, false);
-            if (parent_result) {
-                LOG_TRACE("...found in parent");
-                return parent_result;
+        std::string full_path = m_path_prefix + path;
+        const bool share = m_share_images;
+
+        auto future = std::make_shared<ResourceFutureImpl>();
+        future->m_finalize = [this, id, full_path, share](ResourceFutureImpl &future) -> void* {
+            auto lock = guard();
+            m_pending_images.erase(id.index);
+            if (!future.m_error.empty()) {
+                throw Error { future.m_error };
+            }
+            Stopwatch stopwatch;
+            ALLEGRO_BITMAP *bitmap = share
+                ? m_store_shared_image(id, full_path, *future.m_file_data,
+                        future.m_content_key, future.m_bitmap.release())
+                : m_store_image(id, future.m_bitmap.release());
+            future.m_file_data.reset();
+            m_watch_image(id);
+            m_record_load(m_images[id.index], future.m_decode_us + stopwatch.microseconds());
+            LOG_DEBUG("Finalized image (%s)", image_registry().key(id.index).c_str());
+            return static_cast<void*>(bitmap);
+        };
+
+        // The decoding of a shared image is skipped if another instance
+        // holds it already. Should it be released in the meantime, the image
+        // is decoded upon the finalization.
+        AsyncLoader::instance().decode(future, [full_path, share](ResourceFutureImpl &future) {
+            al_set_new_bitmap_flags(ALLEGRO_MEMORY_BITMAP);
+            if (share) {
+                future.m_file_data = read_file(full_path);
+                future.m_content_key = SharedImageStore::key(*future.m_file_data);
+                if (SharedImageStore::instance().contains(future.m_content_key)) {
+                    return;
+                }
+                future.m_bitmap.reset(decode_image(*future.m_file_data, full_path));
             } else {
-                LOG_TRACE("...didn't find in parent");
+                future.m_bitmap.reset(al_load_bitmap(full_path.c_str()));
             }
-        }
+            if (!future.m_bitmap) {
+                throw Error { std::string { "Failed loading image " } + full_path };
+            }
+        });
 
-        if (can_store) {
-            LOG_TRACE("Is allowed to store resources, trying to load...");
-            ALLEGRO_BITMAP *bitmap = m_load_image(path);
-            LOG_TRACE("...SUCCESS");
-            m_images[path].reset(bitmap);
-            return static_cast<void*>(bitmap);
-        } else {
-            LOG_TRACE("Isn't allowed to store resources, report failure");
-            return nullptr;
-        }
+        m_pending_images[id.index] = future;
+        return ResourceFuture { future };
     }
 
-    void *get_font(const std::string &path, int size, bool can_store)
+    ResourceFuture get_font_async(FontId id)
     {
-        LOG_TRACE("Getting font (%s)", path.c_str());
+        const FontKey &key = font_registry().key(id.index);
+        LOG_TRACE("Getting font asynchronously (%s)", key.first.c_str());
 
-        auto it = m_fonts.find({path, size});
-        if (it != end(m_fonts)) {
-            LOG_TRACE("Found in this instance");
-            return static_cast<void*>(it->second.get());
+        void *available = get_font(id, false);
+        if (available) {
+            return ResourceFuture { ResourceFutureImpl::make_ready(available) };
         }
 
-        if (m_parent) {
-            LOG_TRACE("Didn't find in this instance; parent exists, checking...");
-            void *parent_result = m_parent->m_impl->get_font(path, size, false);
-            if (parent_result) {
-                LOG_TRACE("...found in parent");
-                return parent_result;
-            } else {
-                LOG_TRACE("...didn't find in parent");
-            }
+        // The archived fonts are already in memory
+        const ArchiveRecord *record;
+        if (m_find_archived(key.first, ArchiveRecordType::FONT, record)) {
+            return ResourceFuture { ResourceFutureImpl::make_ready(get_font(id, true)) };
         }
 
-        if (can_store) {
-            LOG_TRACE("Is allowed to store resources, trying to load...");
-            ALLEGRO_FONT *font = m_load_font(path, size);
-            LOG_TRACE("...SUCCESS");
-            m_fonts[{path, size}].reset(font);
-            return static_cast<void*>(font);
-        } else {
-            LOG_TRACE("Isn't allowed to store resources, report failure");
-            return nullptr;
+        auto pending = m_pending_fonts.find(id.index);
+        if (pending != end(m_pending_fonts)) {
+            LOG_TRACE("Already being loaded");
+            return ResourceFuture { pending->second };
+        }
+
+        auto flight = m_font_flights.find(id.index);
+        if (flight != end(m_font_flights)) {
+            return m_await_flight(flight, id,
+                [this](FontId id, bool can_store) { return get_font(id, can_store); });
         }
+
+        // Only the TrueType file is read in the background. The glyphs are
+        // rendered into video bitmaps lazily, hence the font itself is created
+        // on the main thread.
+        auto future = m_make_font_future(id);
+        std::string full_path = m_path_prefix + key.first;
+        bool is_ttf = is_font_path(key.first);
+        AsyncLoader::instance().decode(future, [full_path, is_ttf](ResourceFutureImpl &future) {
+            if (is_ttf) {
+                future.m_file_data = shared_file_data(full_path);
+            }
+        });
+
+        m_pending_fonts[id.index] = future;
+        return ResourceFuture { future };
+    }
+
+    // Creates the font out of the file data read in the background
+    std::shared_ptr<ResourceFutureImpl> m_make_font_future(FontId id)
+    {
+        auto future = std::make_shared<ResourceFutureImpl>();
+        future->m_finalize = [this, id](ResourceFutureImpl &future) -> void* {
+            auto lock = guard();
+            m_pending_fonts.erase(id.index);
+            if (!future.m_error.empty()) {
+                throw Error { future.m_error };
+            }
+            const FontKey &key = font_registry().key(id.index);
+            std::shared_ptr<std::vector<char>> data = std::move(future.m_file_data);
+            Stopwatch stopwatch;
+            ALLEGRO_FONT *font = m_load_font(key.first, key.second, data);
+            const void *face;
+            std::size_t bytes = m_font_bytes(key.first, data, face);
+            FontEntry &entry = m_set_font(id, font, std::move(data), face, bytes);
+            m_record_load(entry, future.m_decode_us + stopwatch.microseconds());
+            return static_cast<void*>(entry.font.get());
+        };
+        return future;
     }
 };
 
 Resources::Resources(const std::string &path_prefix, Resources *parent) :
     m_impl { new ResourcesImpl { path_prefix, parent } } {}
 Resources::~Resources() { delete m_impl; }
-void *Resources::get_image(const std::string &path) { return m_impl->get_image(path, true); }
-void *Resources::get_font(const std::string &path, int size) { return m_impl->get_font(path, size, true); }
+
+// The getters bypass the lock in the concurrent mode to serve the hits
+// without waiting; the paths are interned without locking once seen by the
+// calling thread. The rest of the API locks the instance if needed.
+
+void *Resources::get_image(const std::string &path) { return get_image(intern_image(path)); }
+void *Resources::get_font(const std::string &path, int size) { return get_font(intern_font(path, size)); }
+void *Resources::get_image(ImageId id)
+{
+    return m_impl->is_concurrent() ? m_impl->concurrent_get_image(id) : m_impl->get_image(id, true);
+}
+void *Resources::get_font(FontId id)
+{
+    return m_impl->is_concurrent() ? m_impl->concurrent_get_font(id) : m_impl->get_font(id, true);
+}
+
+ResourceFuture Resources::get_image_async(const std::string &path)
+{
+    auto lock = m_impl->guard();
+    return m_impl->get_image_async(intern_image(path));
+}
+ResourceFuture Resources::get_font_async(const std::string &path, int size)
+{
+    auto lock = m_impl->guard();
+    return m_impl->get_font_async(intern_font(path, size));
+}
+void Resources::enable_atlas(int page_size, int max_image_size)
+{
+    auto lock = m_impl->guard();
+    m_impl->enable_atlas(page_size, max_image_size);
+}
+void *Resources::get_image_variant(const std::string &path, double scale, Color tint, int flags)
+{
+    auto lock = m_impl->guard();
+    return m_impl->get_image_variant(intern_image(path), scale, tint, flags);
+}
+void Resources::enable_image_sharing() { auto lock = m_impl->guard(); m_impl->enable_image_sharing(); }
+void Resources::enable_watch() { auto lock = m_impl->guard(); m_impl->enable_watch(); }
+void Resources::enable_concurrency() { m_impl->enable_concurrency(); }
+void *Resources::get_sample(const std::string &path) { auto lock = m_impl->guard(); return m_impl->get_sample(path, true); }
+AudioStream Resources::open_stream(const std::string &path, int buffer_count, int buffer_samples)
+{
+    return m_impl->open_stream(path, buffer_count, buffer_samples);
+}
+TiledImage Resources::open_tiled_image(const std::string &path, int tile_size, int max_tiles)
+{
+    auto lock = m_impl->guard();
+    return m_impl->open_tiled_image(path, tile_size, max_tiles);
+}
+ResourceFuture Resources::preload(const ResourceManifest &manifest, ProgressCallback progress)
+{
+    auto lock = m_impl->guard();
+    return m_impl->preload(manifest, progress);
+}
+ResourceStats Resources::stats() const { auto lock = m_impl->guard(); return m_impl->stats(); }
+void Resources::dump_stats(std::ostream &out) const { m_impl->dump_stats(out, 0); }
+void Resources::set_glyph_cache_dir(const std::string &path) { auto lock = m_impl->guard(); m_impl->set_glyph_cache_dir(path); }
+void *Resources::get_font_baked(const std::string &path, int size, int first_char, int last_char)
+{
+    auto lock = m_impl->guard();
+    return m_impl->get_font_baked(path, size, first_char, last_char);
+}
+void Resources::mount_archive(const std::string &path) { auto lock = m_impl->guard(); m_impl->mount_archive(path); }
+void Resources::set_memory_budget(std::size_t bytes) { auto lock = m_impl->guard(); m_impl->set_memory_budget(bytes); }
+ImageHandle Resources::get_image_handle(ImageId id) { auto lock = m_impl->guard(); return m_impl->get_image_handle(id); }
+FontHandle Resources::get_font_handle(FontId id) { auto lock = m_impl->guard(); return m_impl->get_font_handle(id); }
+bool Resources::is_valid(const ImageHandle &handle) { auto lock = m_impl->guard(); return m_impl->is_valid(handle); }
+bool Resources::is_valid(const FontHandle &handle) { auto lock = m_impl->guard(); return m_impl->is_valid(handle); }
 
 double image_width(void *image)
 {
@@ -191,7 +3952,11 @@ Frame::Frame(Color clear_color)
 
 Frame::~Frame()
 {
-    al_flip_display();
+    // Headless platforms draw into a memory bitmap with nothing to flip.
+    if (al_get_current_display()) {
+        DICK_PROFILE_SCOPE("flip");
+        al_flip_display();
+    }
 }
 
 struct StateFadeBlack : public dick::StateNode {
@@ -219,6 +3984,8 @@ public:
         m_timer { m_period }
     {}
 
+    int input_interest() const override { return InputInterest::NONE; }
+
     void tick(double dt) override
     {
         if (t_is_over) {
@@ -342,6 +4109,24 @@ public:
             m_potential_transition();
         }
     }
+
+    bool needs_redraw() const
+    {
+        return m_current_state && m_current_state->needs_redraw();
+    }
+
+    int input_interest() const
+    {
+        return m_current_state ? m_current_state->input_interest() : InputInterest::NONE;
+    }
+
+    void on_cursor_motion(DimScreen position, DimScreen delta)
+    {
+        if (m_current_state) {
+            m_current_state->on_cursor_motion(position, delta);
+            m_potential_transition();
+        }
+    }
 };
 
 StateMachine::StateMachine(std::shared_ptr<StateNode> init_state) :
@@ -355,6 +4140,12 @@ void StateMachine::on_button(Button button, bool down) { m_impl->on_button(butto
 void StateMachine::on_cursor(DimScreen position) { m_impl->on_cursor(position); }
 void StateMachine::tick(double dt) { m_impl->tick(dt); }
 void StateMachine::draw(double weight) { m_impl->draw(weight); }
+bool StateMachine::needs_redraw() const { return m_impl->needs_redraw(); }
+int StateMachine::input_interest() const { return m_impl->input_interest(); }
+void StateMachine::on_cursor_motion(DimScreen position, DimScreen delta)
+{
+    m_impl->on_cursor_motion(position, delta);
+}
 
 void GUI::Widget::debug_draw() const
 {
@@ -1529,13 +5320,506 @@ std::unique_ptr<GUI::WidgetContainer> GUI::make_container_rail(
     return m_impl->make_container_rail(direction, stride, offset);
 }
 
-std::unique_ptr<GUI::WidgetContainer> GUI::make_container_box(
-        Direction::Enum direction,
-        double spacing,
-        const DimScreen& offset)
-{
-    return m_impl->make_container_box(direction, spacing, offset);
-}
+std::unique_ptr<GUI::WidgetContainer> GUI::make_container_box(
+        Direction::Enum direction,
+        double spacing,
+        const DimScreen& offset)
+{
+    return m_impl->make_container_box(direction, spacing, offset);
+}
+
+// Job system
+// ----------
+
+struct JobCounterImpl {
+    std::atomic<int> pending;
+    std::mutex mutex;
+    std::vector<std::function<void()>> dependents;
+    std::exception_ptr error;
+
+    JobCounterImpl() : pending { 0 } {}
+};
+
+JobCounter::JobCounter() : m_impl { std::make_shared<JobCounterImpl>() } {}
+
+bool JobCounter::done() const { return m_impl->pending.load() == 0; }
+
+class JobsImpl {
+
+    struct Job {
+        std::function<void()> function;
+        std::shared_ptr<JobCounterImpl> counter;
+    };
+
+    struct Worker {
+        std::mutex mutex;
+        std::deque<Job> jobs;
+        std::thread thread;
+    };
+
+    // The workers sleep on the condition variable while nothing is queued,
+    // and so do the waiting threads until a job is queued or a counter is
+    // done
+    std::vector<std::unique_ptr<Worker>> m_workers;
+    std::atomic<unsigned> m_next_worker;
+    std::atomic<int> m_queued;
+    std::mutex m_sleep_mutex;
+    std::condition_variable m_sleep_cv;
+    bool m_stop;
+
+    // The pool and the worker index of the calling thread, if it's a worker
+    static thread_local JobsImpl *t_pool;
+    static thread_local std::size_t t_index;
+
+    void m_push(Job job)
+    {
+        const std::size_t index = t_pool == this ?
+            t_index :
+            m_next_worker.fetch_add(1) % m_workers.size();
+        {
+            std::lock_guard<std::mutex> lock { m_workers[index]->mutex };
+            m_workers[index]->jobs.push_back(std::move(job));
+        }
+        m_queued.fetch_add(1);
+        {
+            std::lock_guard<std::mutex> lock { m_sleep_mutex };
+        }
+        m_sleep_cv.notify_one();
+    }
+
+    // Takes the newest job of the own deque or the oldest of another one
+    bool m_pop(Job &job)
+    {
+        const bool own = t_pool == this;
+        const std::size_t count = m_workers.size();
+        const std::size_t first = own ? t_index : m_next_worker.load() % count;
+
+        for (std::size_t i = 0; i < count; ++i) {
+            const std::size_t index = (first + i) % count;
+            Worker &worker = *m_workers[index];
+            std::lock_guard<std::mutex> lock { worker.mutex };
+            if (worker.jobs.empty()) {
+                continue;
+            }
+            if (own && index == t_index) {
+                job = std::move(worker.jobs.back());
+                worker.jobs.pop_back();
+            } else {
+                job = std::move(worker.jobs.front());
+                worker.jobs.pop_front();
+            }
+            m_queued.fetch_sub(1);
+            return true;
+        }
+        return false;
+    }
+
+    void m_execute(Job &job)
+    {
+        JobCounterImpl &counter = *job.counter;
+        try {
+            DICK_PROFILE_SCOPE("job");
+            job.function();
+        } catch (...) {
+            std::lock_guard<std::mutex> lock { counter.mutex };
+            if (!counter.error) {
+                counter.error = std::current_exception();
+            }
+        }
+
+        if (counter.pending.fetch_sub(1) == 1) {
+            std::vector<std::function<void()>> dependents;
+            {
+                std::lock_guard<std::mutex> lock { counter.mutex };
+                dependents.swap(counter.dependents);
+            }
+            for (auto &start : dependents) {
+                start();
+            }
+            {
+                std::lock_guard<std::mutex> lock { m_sleep_mutex };
+            }
+            m_sleep_cv.notify_all();
+        }
+    }
+
+    void m_work(std::size_t index)
+    {
+        t_pool = this;
+        t_index = index;
+        name_profiled_thread("jobs");
+
+        while (true) {
+            Job job;
+            if (m_pop(job)) {
+                m_execute(job);
+                continue;
+            }
+
+            std::unique_lock<std::mutex> lock { m_sleep_mutex };
+            m_sleep_cv.wait(lock, [this]() { return m_stop || m_queued.load() > 0; });
+            if (m_stop) {
+                return;
+            }
+        }
+    }
+
+public:
+    JobsImpl(unsigned threads) :
+        m_next_worker { 0 },
+        m_queued { 0 },
+        m_stop { false }
+    {
+        if (!threads) {
+            const unsigned cores = std::thread::hardware_concurrency();
+            threads = cores > 1 ? cores - 1 : 1;
+        }
+
+        LOG_DEBUG("Starting %u job threads", threads);
+        for (unsigned i = 0; i < threads; ++i) {
+            m_workers.emplace_back(new Worker);
+        }
+        for (std::size_t i = 0; i < m_workers.size(); ++i) {
+            m_workers[i]->thread = std::thread { [this, i]() { m_work(i); } };
+        }
+    }
+
+    ~JobsImpl()
+    {
+        {
+            std::lock_guard<std::mutex> lock { m_sleep_mutex };
+            m_stop = true;
+        }
+        m_sleep_cv.notify_all();
+        for (auto &worker : m_workers) {
+            worker->thread.join();
+        }
+    }
+
+    unsigned thread_count() const { return static_cast<unsigned>(m_workers.size()); }
+
+    void run(std::function<void()> job, JobCounter &counter)
+    {
+        counter.m_impl->pending.fetch_add(1);
+        m_push({ std::move(job), counter.m_impl });
+    }
+
+    void run_after(const JobCounter &dependency, std::function<void()> job, JobCounter &counter)
+    {
+        counter.m_impl->pending.fetch_add(1);
+        auto start = [this, job, counter]() { m_push({ job, counter.m_impl }); };
+
+        JobCounterImpl &awaited = *dependency.m_impl;
+        {
+            std::lock_guard<std::mutex> lock { awaited.mutex };
+            if (awaited.pending.load() > 0) {
+                awaited.dependents.push_back(std::move(start));
+                return;
+            }
+        }
+        start();
+    }
+
+    // Helps with the queued jobs meanwhile. Once there is nothing to steal
+    // for a while, blocks instead of spinning.
+    void wait(const JobCounter &counter)
+    {
+        const int SPINS = 64;
+        int idle = 0;
+        while (!counter.done()) {
+            Job job;
+            if (m_pop(job)) {
+                m_execute(job);
+                idle = 0;
+            } else if (++idle < SPINS) {
+                std::this_thread::yield();
+            } else {
+                std::unique_lock<std::mutex> lock { m_sleep_mutex };
+                m_sleep_cv.wait(lock, [this, &counter]() {
+                    return counter.done() || m_queued.load() > 0;
+                });
+                idle = 0;
+            }
+        }
+
+        JobCounterImpl &awaited = *counter.m_impl;
+        std::exception_ptr error;
+        {
+            std::lock_guard<std::mutex> lock { awaited.mutex };
+            error = awaited.error;
+            awaited.error = nullptr;
+        }
+        if (error) {
+            std::rethrow_exception(error);
+        }
+    }
+
+    void parallel_for(
+            std::size_t begin, std::size_t end,
+            const std::function<void(std::size_t, std::size_t)> &body,
+            std::size_t grain)
+    {
+        if (begin >= end) {
+            return;
+        }
+
+        const std::size_t size = end - begin;
+        if (!grain) {
+            const std::size_t chunks = 4 * (m_workers.size() + 1);
+            grain = std::max<std::size_t>(1, (size + chunks - 1) / chunks);
+        }
+
+        JobCounter counter;
+        for (std::size_t first = begin; first < end; first += std::min(grain, end - first)) {
+            const std::size_t last = first + std::min(grain, end - first);
+            run([&body, first, last]() { body(first, last); }, counter);
+        }
+        wait(counter);
+    }
+};
+
+thread_local JobsImpl *JobsImpl::t_pool = nullptr;
+thread_local std::size_t JobsImpl::t_index = 0;
+
+Jobs::Jobs(unsigned threads) : m_impl { new JobsImpl { threads } } {}
+Jobs::~Jobs() { delete m_impl; }
+unsigned Jobs::thread_count() const { return m_impl->thread_count(); }
+void Jobs::run(std::function<void()> job, JobCounter &counter) { m_impl->run(std::move(job), counter); }
+void Jobs::run_after(const JobCounter &dependency, std::function<void()> job, JobCounter &counter)
+{
+    m_impl->run_after(dependency, std::move(job), counter);
+}
+void Jobs::wait(const JobCounter &counter) { m_impl->wait(counter); }
+void Jobs::parallel_for(
+        std::size_t begin, std::size_t end,
+        const std::function<void(std::size_t, std::size_t)> &body,
+        std::size_t grain)
+{
+    m_impl->parallel_for(begin, end, body, grain);
+}
+
+// Input recording
+// ---------------
+
+// The binary input log is the magic followed by the records, each being the
+// record type byte, the tick index as a variable length delta from the
+// previous record's and the payload: the key or button code as a variable
+// length integer or the cursor coordinates, followed by the motion for the
+// coalesced cursor events, as little endian doubles. The end record's tick
+// index is the number of ticks of the session.
+const char INPUT_LOG_MAGIC[8] = { 'D', 'I', 'C', 'K', 'I', 'N', 'P', '1' };
+
+struct InputRecord {
+    enum Type : std::uint8_t {
+        END,
+        KEY_DOWN,
+        KEY_UP,
+        BUTTON_DOWN,
+        BUTTON_UP,
+        CURSOR,
+        CURSOR_MOTION
+    };
+
+    Type type;
+    std::uint64_t tick;
+    int code;
+    DimScreen position;
+    DimScreen delta;
+};
+
+class InputRecorder {
+    std::ofstream m_file;
+    std::string m_path;
+    std::uint64_t m_last_tick;
+
+    void m_write_varint(std::uint64_t value)
+    {
+        while (value >= 0x80) {
+            m_file.put(static_cast<char>((value & 0x7f) | 0x80));
+            value >>= 7;
+        }
+        m_file.put(static_cast<char>(value));
+    }
+
+    void m_write_double(double value)
+    {
+        std::uint64_t bits;
+        std::memcpy(&bits, &value, sizeof(bits));
+        for (int i = 0; i < 8; ++i) {
+            m_file.put(static_cast<char>(bits >> (i * 8)));
+        }
+    }
+
+    void m_write_header(InputRecord::Type type, std::uint64_t tick)
+    {
+        m_file.put(static_cast<char>(type));
+        m_write_varint(tick - m_last_tick);
+        m_last_tick = tick;
+    }
+
+public:
+    InputRecorder(const std::string &path) :
+        m_file { path, std::ios::binary },
+        m_path { path },
+        m_last_tick { 0 }
+    {
+        if (!m_file) {
+            throw Error { "Failed opening input log " + path };
+        }
+        m_file.write(INPUT_LOG_MAGIC, sizeof(INPUT_LOG_MAGIC));
+    }
+
+    void code(InputRecord::Type type, std::uint64_t tick, int code)
+    {
+        m_write_header(type, tick);
+        m_write_varint(static_cast<std::uint64_t>(code));
+    }
+
+    void cursor(std::uint64_t tick, DimScreen position)
+    {
+        m_write_header(InputRecord::CURSOR, tick);
+        m_write_double(position.x);
+        m_write_double(position.y);
+    }
+
+    void cursor_motion(std::uint64_t tick, DimScreen position, DimScreen delta)
+    {
+        m_write_header(InputRecord::CURSOR_MOTION, tick);
+        m_write_double(position.x);
+        m_write_double(position.y);
+        m_write_double(delta.x);
+        m_write_double(delta.y);
+    }
+
+    void end(std::uint64_t ticks)
+    {
+        m_write_header(InputRecord::END, ticks);
+        m_file.close();
+        if (!m_file) {
+            throw Error { "Failed writing input log " + m_path };
+        }
+    }
+};
+
+// The log is read up front, so that the replay involves no I/O
+class InputReplay {
+    std::vector<InputRecord> m_records;
+    std::size_t m_next;
+
+public:
+    InputReplay(const std::string &path) : m_next { 0 }
+    {
+        std::vector<char> data;
+        {
+            std::ifstream file { path, std::ios::binary };
+            if (!file) {
+                throw Error { "Failed opening input log " + path };
+            }
+            data.assign(std::istreambuf_iterator<char> { file }, {});
+        }
+
+        const Error error { "Malformed input log " + path };
+        std::size_t offset = 0;
+        auto read_byte = [&]() -> std::uint8_t {
+            if (offset >= data.size()) {
+                throw error;
+            }
+            return static_cast<std::uint8_t>(data[offset++]);
+        };
+        auto read_varint = [&]() {
+            std::uint64_t value = 0;
+            for (int shift = 0; ; shift += 7) {
+                const std::uint8_t byte = read_byte();
+                if (shift > 63) {
+                    throw error;
+                }
+                value |= static_cast<std::uint64_t>(byte & 0x7f) << shift;
+                if (!(byte & 0x80)) {
+                    return value;
+                }
+            }
+        };
+        auto read_double = [&]() {
+            std::uint64_t bits = 0;
+            for (int i = 0; i < 8; ++i) {
+                bits |= static_cast<std::uint64_t>(read_byte()) << (i * 8);
+            }
+            double value;
+            std::memcpy(&value, &bits, sizeof(value));
+            return value;
+        };
+
+        if (data.size() < sizeof(INPUT_LOG_MAGIC) ||
+                std::memcmp(data.data(), INPUT_LOG_MAGIC, sizeof(INPUT_LOG_MAGIC))) {
+            throw error;
+        }
+        offset = sizeof(INPUT_LOG_MAGIC);
+
+        std::uint64_t tick = 0;
+        while (true) {
+            InputRecord record {};
+            const std::uint8_t type = read_byte();
+            if (type > InputRecord::CURSOR_MOTION) {
+                throw error;
+            }
+            record.type = static_cast<InputRecord::Type>(type);
+            tick += read_varint();
+            record.tick = tick;
+            if (record.type == InputRecord::CURSOR ||
+                    record.type == InputRecord::CURSOR_MOTION) {
+                record.position.x = read_double();
+                record.position.y = read_double();
+                if (record.type == InputRecord::CURSOR_MOTION) {
+                    record.delta.x = read_double();
+                    record.delta.y = read_double();
+                }
+            } else if (record.type != InputRecord::END) {
+                const std::uint64_t code = read_varint();
+                const bool is_key = record.type == InputRecord::KEY_DOWN ||
+                        record.type == InputRecord::KEY_UP;
+                const int limit = is_key ? static_cast<int>(Key::MAX) : static_cast<int>(Button::MAX);
+                if (code >= static_cast<std::uint64_t>(limit)) {
+                    throw error;
+                }
+                record.code = static_cast<int>(code);
+            }
+            m_records.push_back(record);
+            if (record.type == InputRecord::END) {
+                break;
+            }
+        }
+
+        LOG_DEBUG("Read %zu input records from %s", m_records.size() - 1, path.c_str());
+    }
+
+    std::uint64_t ticks() const { return m_records.back().tick; }
+
+    // Delivers the events preceding the given tick
+    void deliver(PlatformClient &client, std::uint64_t tick)
+    {
+        for (; m_next < m_records.size() && m_records[m_next].tick <= tick; ++m_next) {
+            const InputRecord &record = m_records[m_next];
+            switch (record.type) {
+            case InputRecord::KEY_DOWN:
+            case InputRecord::KEY_UP:
+                client.on_key(static_cast<Key>(record.code), record.type == InputRecord::KEY_DOWN);
+                break;
+            case InputRecord::BUTTON_DOWN:
+            case InputRecord::BUTTON_UP:
+                client.on_button(static_cast<Button>(record.code), record.type == InputRecord::BUTTON_DOWN);
+                break;
+            case InputRecord::CURSOR:
+                client.on_cursor(record.position);
+                break;
+            case InputRecord::CURSOR_MOTION:
+                client.on_cursor_motion(record.position, record.delta);
+                break;
+            case InputRecord::END:
+                return;
+            }
+        }
+    }
+};
 
 class PlatformImpl {
 
@@ -1556,11 +5840,114 @@ class PlatformImpl {
         }
     };
 
+    struct TimerDeleter {
+        void operator()(ALLEGRO_TIMER *timer) {
+            LOG_DEBUG("Deleting timer (%p)", timer);
+            al_destroy_timer(timer);
+        }
+    };
+
     // Platform state
     // --------------
 
-    const double m_fps;
+    // Loop timing configuration. In the slowdown mode the time that couldn't
+    // be caught up with is carried over to the next frames, but no more than
+    // the backlog limit.
+    double m_tick_rate;
+    int m_max_catch_up_ticks;
+    CatchUp::Enum m_catch_up;
+    bool m_variable_step;
+    const double m_max_backlog;
+
+    // The counters the simulation thread of the pipelined loop updates are
+    // atomic, so that the stats may be read on the main thread meanwhile.
+    // They only have one writer at a time.
+    LoopStats m_loop_stats;
+    std::atomic<std::uint64_t> m_ticks;
+    std::atomic<double> m_dropped_time;
+
+    const double m_load_budget;
     bool m_kill_flag;
+
+    // Event driven loop state; the ticks are counted by the timer events and
+    // the input makes the frame dirty.
+    bool m_event_driven;
+    bool m_render_when_dirty;
+    int m_pending_ticks;
+    bool m_dirty;
+    bool m_coalesce_cursor;
+
+    // Headless mode state; the target replaces the display's back buffer.
+    bool m_headless;
+    std::uint64_t m_headless_ticks;
+    int m_draw_interval;
+    std::unique_ptr<ALLEGRO_BITMAP, BitmapDeleter> m_target;
+
+    // Pipelined loop state. The input is queued by the main thread for the
+    // simulation thread, which in turn hands the snapshots over through the
+    // triple buffer: the latest slot index along with the fresh flag.
+    class InputQueue : public PlatformClient {
+        std::mutex m_mutex;
+        std::vector<std::function<void(PlatformClient&)>> m_events;
+
+        void m_push(std::function<void(PlatformClient&)> event)
+        {
+            std::lock_guard<std::mutex> lock { m_mutex };
+            m_events.push_back(std::move(event));
+        }
+
+    public:
+        std::atomic<bool> over { false };
+        std::atomic<int> interest { InputInterest::ALL };
+
+        bool is_over() const override { return over.load(); }
+        int input_interest() const override { return interest.load(); }
+        void on_key(Key key, bool down) override
+        {
+            m_push([key, down](PlatformClient &client) { client.on_key(key, down); });
+        }
+        void on_button(Button button, bool down) override
+        {
+            m_push([button, down](PlatformClient &client) { client.on_button(button, down); });
+        }
+        void on_cursor(DimScreen position) override
+        {
+            m_push([position](PlatformClient &client) { client.on_cursor(position); });
+        }
+        void on_cursor_motion(DimScreen position, DimScreen delta) override
+        {
+            m_push([position, delta](PlatformClient &client) {
+                client.on_cursor_motion(position, delta);
+            });
+        }
+        void tick(double) override {}
+        void draw(double) override {}
+
+        void deliver(PlatformClient &client)
+        {
+            std::vector<std::function<void(PlatformClient&)>> events;
+            {
+                std::lock_guard<std::mutex> lock { m_mutex };
+                events.swap(m_events);
+            }
+            for (auto &event : events) {
+                event(client);
+            }
+        }
+    };
+
+    std::unique_ptr<Jobs> m_jobs;
+
+    // Input log state; the tick index counts the ticks of the current loop.
+    std::unique_ptr<InputRecorder> m_recorder;
+    std::unique_ptr<InputReplay> m_replay;
+    std::uint64_t m_tick_index;
+
+    static const int FRESH_SNAPSHOT = 4;
+    std::atomic<int> m_latest_snapshot;
+    double m_publish_times[PipelinedClient::SNAPSHOT_SLOTS];
+    std::atomic<bool> m_stop_simulation;
+
     std::unique_ptr<ALLEGRO_DISPLAY, DisplayDeleter> m_display;
     std::unique_ptr<ALLEGRO_EVENT_QUEUE, EvQueueDeleter> m_ev_queue;
 
@@ -1629,9 +6016,96 @@ class PlatformImpl {
         }
     }
 
+    // The client's loop phases, timed by the profiler. The replayed input is
+    // delivered right before the ticks and the loop is stopped once all the
+    // recorded ticks have passed.
+    void m_tick(PlatformClient &client, double dt)
+    {
+        if (m_replay) {
+            if (m_tick_index >= m_replay->ticks()) {
+                m_kill_flag = true;
+                return;
+            }
+            m_replay->deliver(client, m_tick_index);
+            if (client.is_over()) return;
+        }
+
+        DICK_PROFILE_SCOPE("tick");
+        client.tick(dt);
+        ++m_tick_index;
+        m_ticks.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    // The live input dispatch, logged if recording and ignored if replaying
+    void m_on_key(PlatformClient &client, Key key, bool down)
+    {
+        if (m_replay) return;
+        if (m_recorder) {
+            m_recorder->code(
+                    down ? InputRecord::KEY_DOWN : InputRecord::KEY_UP,
+                    m_tick_index, static_cast<int>(key));
+        }
+        client.on_key(key, down);
+    }
+
+    void m_on_button(PlatformClient &client, Button button, bool down)
+    {
+        if (m_replay) return;
+        if (m_recorder) {
+            m_recorder->code(
+                    down ? InputRecord::BUTTON_DOWN : InputRecord::BUTTON_UP,
+                    m_tick_index, static_cast<int>(button));
+        }
+        client.on_button(button, down);
+    }
+
+    void m_on_cursor(PlatformClient &client, DimScreen position)
+    {
+        if (m_replay) return;
+        if (m_recorder) {
+            m_recorder->cursor(m_tick_index, position);
+        }
+        client.on_cursor(position);
+    }
+
+    void m_on_cursor_motion(PlatformClient &client, DimScreen position, DimScreen delta)
+    {
+        if (m_replay) return;
+        if (m_recorder) {
+            m_recorder->cursor_motion(m_tick_index, position, delta);
+        }
+        client.on_cursor_motion(position, delta);
+    }
+
+    void m_draw(PlatformClient &client, double weight)
+    {
+        DICK_PROFILE_SCOPE("draw");
+        client.draw(weight);
+    }
+
     // Handles all the stimuli from the outside world
     void m_process_events(PlatformClient &client)
     {
+        if (al_is_event_queue_empty(m_ev_queue.get())) {
+            return;
+        }
+
+        DICK_PROFILE_SCOPE("events");
+        const int interest = client.input_interest();
+
+        // The coalesced cursor motion is dispatched before the button events
+        // and at the end, so that the clicks happen at the right positions.
+        bool cursor_moved = false;
+        DimScreen cursor { 0, 0 };
+        DimScreen delta { 0, 0 };
+        auto dispatch_cursor = [&]() {
+            if (cursor_moved) {
+                m_on_cursor_motion(client, cursor, delta);
+                cursor_moved = false;
+                delta = { 0, 0 };
+            }
+        };
+
         ALLEGRO_EVENT event;
         while (!al_is_event_queue_empty(m_ev_queue.get())) {
             al_get_next_event(m_ev_queue.get(), &event);
@@ -1642,26 +6116,57 @@ class PlatformImpl {
                 return;
 
             case ALLEGRO_EVENT_KEY_DOWN:
-                client.on_key(m_platform_to_dick_key(event.keyboard.keycode), true);
-                break;
-
             case ALLEGRO_EVENT_KEY_UP:
-                client.on_key(m_platform_to_dick_key(event.keyboard.keycode), false);
+                if (!(interest & InputInterest::KEYS)) {
+                    break;
+                }
+                m_on_key(
+                        client,
+                        m_platform_to_dick_key(event.keyboard.keycode),
+                        event.type == ALLEGRO_EVENT_KEY_DOWN);
+                m_dirty = true;
                 break;
 
             case ALLEGRO_EVENT_MOUSE_BUTTON_DOWN:
-                client.on_button(m_platform_to_dick_button(event.mouse.button), true);
-                break;
-
             case ALLEGRO_EVENT_MOUSE_BUTTON_UP:
-                client.on_button(m_platform_to_dick_button(event.mouse.button), false);
+                if (!(interest & InputInterest::BUTTONS)) {
+                    break;
+                }
+                dispatch_cursor();
+                m_on_button(
+                        client,
+                        m_platform_to_dick_button(event.mouse.button),
+                        event.type == ALLEGRO_EVENT_MOUSE_BUTTON_DOWN);
+                m_dirty = true;
                 break;
 
             case ALLEGRO_EVENT_MOUSE_AXES:
-                client.on_cursor(DimScreen {
+                if (!(interest & InputInterest::CURSOR)) {
+                    break;
+                }
+                if (m_coalesce_cursor) {
+                    cursor = {
                         static_cast<double>(event.mouse.x),
                         static_cast<double>(event.mouse.y)
-                        });
+                    };
+                    delta.x += event.mouse.dx;
+                    delta.y += event.mouse.dy;
+                    cursor_moved = true;
+                } else {
+                    m_on_cursor(client, DimScreen {
+                            static_cast<double>(event.mouse.x),
+                            static_cast<double>(event.mouse.y)
+                            });
+                }
+                m_dirty = true;
+                break;
+
+            case ALLEGRO_EVENT_DISPLAY_EXPOSE:
+                m_dirty = true;
+                break;
+
+            case ALLEGRO_EVENT_TIMER:
+                ++m_pending_ticks;
                 break;
 
             default:
@@ -1669,67 +6174,245 @@ class PlatformImpl {
             }
 
             if (client.is_over()) {
-                break;
+                return;
             }
         }
+
+        dispatch_cursor();
     }
 
     // Updates client's state object and reacts to stimuli coming from it
     void m_realtime_loop_step(double &current_time, double &accumulator, PlatformClient& client)
     {
-        static const double max_frame_time = 0.05;
-        const double spf = 1.0 / m_fps;
+        const double spf = 1.0 / m_tick_rate;
         const double new_time = al_get_time();
 
         double frame_time = new_time - current_time;
+        current_time = new_time;
+        ++m_loop_stats.frames;
 
-        if (frame_time > max_frame_time) {
-            frame_time = max_frame_time;
+        if (m_variable_step && !m_replay) {
+            const double max_step = m_max_catch_up_ticks * spf;
+            if (frame_time > max_step) {
+                m_add_dropped_time(frame_time - max_step);
+                frame_time = max_step;
+            }
+            m_tick(client, frame_time);
+            if (!client.is_over()) {
+                m_draw(client, 0.0);
+            }
+            return;
         }
 
-        current_time = new_time;
         accumulator += frame_time;
 
-        while (accumulator >= spf) {
-            client.tick(spf);
+        for (int ticks = 0; accumulator >= spf && ticks < m_max_catch_up_ticks; ++ticks) {
+            m_tick(client, spf);
             if (client.is_over()) {
                 return;
             }
             accumulator -= spf;
         }
 
-        const double frame_weight = accumulator / spf;
-        client.draw(frame_weight);
+        m_limit_backlog(accumulator, spf);
+
+        const double frame_weight = std::min(accumulator / spf, 1.0);
+        m_draw(client, frame_weight);
     }
 
-public:
-    ~PlatformImpl()
+    void m_add_dropped_time(double time)
     {
-        m_ev_queue.reset();
-        al_uninstall_audio();
-        al_uninstall_mouse();
-        al_uninstall_keyboard();
-        m_display.reset();
-        al_shutdown_primitives_addon();
-        al_shutdown_ttf_addon();
-        al_shutdown_font_addon();
-        al_shutdown_image_addon();
-        al_uninstall_system();
+        m_dropped_time.store(m_dropped_time.load(std::memory_order_relaxed) + time, std::memory_order_relaxed);
+    }
+
+    // Applies the catch up policy to the time left after a frame's ticks
+    void m_limit_backlog(double &backlog, double spf)
+    {
+        double limit = m_catch_up == CatchUp::DROP ? spf : std::max(m_max_backlog, spf);
+        if (backlog >= limit) {
+            const double dropped = m_catch_up == CatchUp::DROP ?
+                std::floor(backlog / spf) * spf :
+                backlog - limit;
+            m_add_dropped_time(dropped);
+            backlog -= dropped;
+        }
+    }
+
+    // Sleeps until the input or the timer wakes it up. The ticks are aligned
+    // with the timer events, hence the frames are drawn with no interpolation.
+    void m_event_driven_loop(PlatformClient &client)
+    {
+        const double spf = 1.0 / m_tick_rate;
+
+        std::unique_ptr<ALLEGRO_TIMER, TimerDeleter> timer { al_create_timer(spf) };
+        if (!timer) {
+            throw Error { "Failed creating timer" };
+        }
+        ALLEGRO_EVENT_SOURCE *timer_source = al_get_timer_event_source(timer.get());
+        al_register_event_source(m_ev_queue.get(), timer_source);
+        al_start_timer(timer.get());
+
+        m_pending_ticks = 0;
+        m_dirty = true;
+
+        while (true) {
+            ALLEGRO_TIMEOUT timeout;
+            al_init_timeout(&timeout, spf);
+            {
+                DICK_PROFILE_SCOPE("wait");
+                al_wait_for_event_until(m_ev_queue.get(), nullptr, &timeout);
+            }
+            DICK_PROFILE_SCOPE("frame");
+
+            m_process_events(client);
+            if (client.is_over() || m_kill_flag) break;
+            process_pending_loads(m_load_budget);
+
+            ++m_loop_stats.frames;
+            const int ticks = std::min(m_pending_ticks, m_max_catch_up_ticks);
+            double backlog = (m_pending_ticks - ticks) * spf;
+            m_limit_backlog(backlog, spf);
+            m_pending_ticks = static_cast<int>(backlog / spf + 0.5);
+
+            for (int i = 0; i < ticks && !client.is_over(); ++i) {
+                m_tick(client, spf);
+            }
+            if (client.is_over() || m_kill_flag) break;
+
+            const bool redraw = m_render_when_dirty ?
+                m_dirty || (ticks && client.needs_redraw()) :
+                m_dirty || ticks;
+            if (redraw) {
+                m_draw(client, 0.0);
+                m_dirty = false;
+            }
+        }
+
+        al_unregister_event_source(m_ev_queue.get(), timer_source);
+    }
+
+    void m_polling_loop(PlatformClient &client)
+    {
+        double current_time = al_get_time();
+        double accumulator = 0;
+        while (true) {
+            {
+                DICK_PROFILE_SCOPE("poll");
+                m_process_events(client);
+                if (client.is_over() || m_kill_flag) break;
+                process_pending_loads(m_load_budget);
+                m_realtime_loop_step(current_time, accumulator, client);
+                if (client.is_over() || m_kill_flag) break;
+            }
+            al_rest(0.001);
+        }
+    }
+
+    // Runs the client as fast as possible with a fixed step; the simulated
+    // clock is only advanced by the ticks.
+    void m_headless_loop(PlatformClient &client)
+    {
+        const double spf = 1.0 / m_tick_rate;
+
+        for (std::uint64_t tick = 1; ; ++tick) {
+            DICK_PROFILE_SCOPE("frame");
+            m_process_events(client);
+            if (client.is_over() || m_kill_flag) break;
+            process_pending_loads(m_load_budget);
+
+            m_tick(client, spf);
+            if (client.is_over()) break;
+
+            if (m_draw_interval && tick % m_draw_interval == 0) {
+                m_draw(client, 0.0);
+                ++m_loop_stats.frames;
+            }
+
+            if (m_headless_ticks && tick >= m_headless_ticks) break;
+        }
+    }
+
+    // Ticks the client at the tick rate, sleeping when ahead of the clock.
+    // After the limit of ticks in a row without a sleep the backlog is cut
+    // according to the catch up policy.
+    void m_simulation_loop(PipelinedClient &client, InputQueue &input)
+    {
+        name_profiled_thread("simulation");
+        const double spf = 1.0 / m_tick_rate;
+        int write_slot = 0;
+        int ticks_in_row = 0;
+        double next_time = al_get_time();
+        input.interest.store(client.input_interest());
+
+        while (!m_stop_simulation.load()) {
+            input.deliver(client);
+            if (client.is_over()) break;
+
+            m_tick(client, spf);
+            if (client.is_over()) break;
+            input.interest.store(client.input_interest());
+
+            {
+                DICK_PROFILE_SCOPE("publish");
+                client.publish(write_slot);
+            }
+            m_publish_times[write_slot] = al_get_time();
+            write_slot = m_latest_snapshot.exchange(write_slot | FRESH_SNAPSHOT) & ~FRESH_SNAPSHOT;
+
+            next_time += spf;
+            const double now = al_get_time();
+            if (now < next_time) {
+                ticks_in_row = 0;
+                al_rest(next_time - now);
+            } else if (++ticks_in_row >= m_max_catch_up_ticks) {
+                ticks_in_row = 0;
+                double backlog = now - next_time;
+                m_limit_backlog(backlog, spf);
+                next_time = now - backlog;
+            }
+        }
+
+        input.over.store(true);
     }
 
-    PlatformImpl(const DimScreen &screen_size) :
-        m_fps { 50.0 },
-        m_kill_flag {}
+    // Common initialization of the library and the add-ons
+    PlatformImpl() :
+        m_tick_rate { 50.0 },
+        m_max_catch_up_ticks { 3 },
+        m_catch_up { CatchUp::DROP },
+        m_variable_step { false },
+        m_max_backlog { 1.0 },
+        m_loop_stats {},
+        m_ticks { 0 },
+        m_dropped_time { 0.0 },
+        m_load_budget { 0.002 },
+        m_kill_flag {},
+        m_event_driven { false },
+        m_render_when_dirty { false },
+        m_pending_ticks { 0 },
+        m_dirty { true },
+        m_coalesce_cursor { false },
+        m_headless { false },
+        m_headless_ticks { 0 },
+        m_draw_interval { 0 },
+        m_tick_index { 0 },
+        m_latest_snapshot { 0 },
+        m_publish_times {},
+        m_stop_simulation { false }
     {
         if (!al_install_system(ALLEGRO_VERSION_INT, atexit)) {
             throw Error { "Failed initializing core allegro" };
         }
         LOG_TRACE("Initialized core allegro");
+        name_profiled_thread("main");
+
+        m_jobs.reset(new Jobs);
 
         if (!al_init_image_addon()) {
             throw Error { "Failed initializing image add-on" };
             exit(1);
         }
+        register_qoi_format();
         LOG_TRACE("Initialized image add-on");
 
         al_init_font_addon();
@@ -1753,6 +6436,34 @@ public:
         }
         LOG_TRACE("Initialized primitives add-on");
 
+        m_ev_queue.reset(al_create_event_queue());
+        if (!m_ev_queue) {
+            throw Error { "Failed creating event queue" };
+            exit(1);
+        }
+        LOG_TRACE("Initialized event queue");
+    }
+
+public:
+    ~PlatformImpl()
+    {
+        m_jobs.reset();
+        AsyncLoader::instance().shutdown();
+        m_ev_queue.reset();
+        al_uninstall_audio();
+        al_uninstall_mouse();
+        al_uninstall_keyboard();
+        m_target.reset();
+        m_display.reset();
+        al_shutdown_primitives_addon();
+        al_shutdown_ttf_addon();
+        al_shutdown_font_addon();
+        al_shutdown_image_addon();
+        al_uninstall_system();
+    }
+
+    PlatformImpl(const DimScreen &screen_size) : PlatformImpl {}
+    {
         m_display.reset(al_create_display(screen_size.x, screen_size.y));
         if (!m_display) {
             throw Error { "Failed creating display" };
@@ -1778,12 +6489,11 @@ public:
         }
         LOG_TRACE("Installed audio");
 
-        m_ev_queue.reset(al_create_event_queue());
-        if (!m_ev_queue) {
-            throw Error { "Failed creating event queue" };
+        if (!al_reserve_samples(16)) {
+            throw Error { "Failed reserving audio samples" };
             exit(1);
         }
-        LOG_TRACE("Initialized event queue");
+        LOG_TRACE("Reserved audio samples");
 
         al_register_event_source(m_ev_queue.get(), al_get_display_event_source(m_display.get()));
         al_register_event_source(m_ev_queue.get(), al_get_keyboard_event_source());
@@ -1791,24 +6501,200 @@ public:
         LOG_TRACE("Attached event listeners");
     }
 
+    // With no display all the bitmaps, the resources included, are created
+    // in the memory and drawn by the software renderer.
+    PlatformImpl(const Headless &headless) : PlatformImpl {}
+    {
+        if (headless.draw_interval < 0) {
+            throw Error { "Invalid headless draw interval" };
+        }
+        m_headless = true;
+        m_headless_ticks = headless.ticks;
+        m_draw_interval = headless.draw_interval;
+
+        al_set_new_bitmap_flags(ALLEGRO_MEMORY_BITMAP);
+        m_target.reset(al_create_bitmap(headless.screen_size.x, headless.screen_size.y));
+        if (!m_target) {
+            throw Error { "Failed creating headless target bitmap" };
+        }
+        al_set_target_bitmap(m_target.get());
+        LOG_TRACE("Initialized headless target");
+    }
+
+    void set_tick_rate(double ticks_per_second)
+    {
+        if (!(ticks_per_second > 0.0)) {
+            throw Error { "Invalid tick rate" };
+        }
+        m_tick_rate = ticks_per_second;
+    }
+
+    void set_max_catch_up_ticks(int ticks)
+    {
+        if (ticks < 1) {
+            throw Error { "Invalid catch up ticks limit" };
+        }
+        m_max_catch_up_ticks = ticks;
+    }
+
+    void set_catch_up_policy(CatchUp::Enum policy) { m_catch_up = policy; }
+    void set_variable_step(bool variable_step) { m_variable_step = variable_step; }
+    LoopStats loop_stats() const
+    {
+        LoopStats result = m_loop_stats;
+        result.ticks = m_ticks.load(std::memory_order_relaxed);
+        result.dropped_time = m_dropped_time.load(std::memory_order_relaxed);
+        return result;
+    }
+
+    void dump_loop_stats(std::ostream &out) const
+    {
+        const LoopStats stats = loop_stats();
+        const double run_time = stats.run_time;
+        out << "frames: " << stats.frames
+            << ", ticks: " << stats.ticks
+            << ", dropped: " << stats.dropped_time << " s"
+            << ", run time: " << run_time << " s";
+        if (run_time > 0.0) {
+            out << ", ticks/s: " << stats.ticks / run_time
+                << ", frames/s: " << stats.frames / run_time;
+        }
+        out << std::endl;
+    }
+
+    void set_event_driven(bool event_driven, bool render_when_dirty)
+    {
+        m_event_driven = event_driven;
+        m_render_when_dirty = render_when_dirty;
+    }
+
+    void set_cursor_coalescing(bool coalescing) { m_coalesce_cursor = coalescing; }
+
+    Jobs &jobs() { return *m_jobs; }
+
+    void record_input(const std::string &path)
+    {
+        m_replay.reset();
+        m_recorder.reset(new InputRecorder { path });
+    }
+
+    void replay_input(const std::string &path)
+    {
+        m_recorder.reset();
+        m_replay.reset(new InputReplay { path });
+    }
+
     void real_time_loop(PlatformClient &client)
     {
-        double current_time = al_get_time();
-        double accumulator = 0;
+        const double start_time = al_get_time();
         m_kill_flag = false;
+        m_tick_index = 0;
 
-        while (true) {
-            m_process_events(client);
-            if (client.is_over() || m_kill_flag) break;
-            m_realtime_loop_step(current_time, accumulator, client);
-            if (client.is_over() || m_kill_flag) break;
-            al_rest(0.001);
+        if (m_headless) {
+            m_headless_loop(client);
+        } else if (m_event_driven) {
+            m_event_driven_loop(client);
+        } else {
+            m_polling_loop(client);
+        }
+        m_loop_stats.run_time += al_get_time() - start_time;
+
+        if (m_recorder) {
+            m_recorder->end(m_tick_index);
+            m_recorder.reset();
+        }
+        m_replay.reset();
+
+        if (m_headless) {
+            dump_loop_stats(std::clog);
+        }
+    }
+
+    void pipelined_loop(PipelinedClient &client)
+    {
+        if (m_recorder || m_replay) {
+            throw Error { "Input recording and replay not supported by the pipelined loop" };
+        }
+
+        const double start_time = al_get_time();
+        const double spf = 1.0 / m_tick_rate;
+        m_kill_flag = false;
+
+        // The slot 0 is initially the writer's, 1 is the latest and 2 is
+        // the reader's, with nothing fresh to draw.
+        m_latest_snapshot.store(1);
+        m_stop_simulation.store(false);
+        int read_slot = 2;
+        bool published = false;
+
+        InputQueue input;
+        std::exception_ptr error;
+        std::thread simulation { [this, &client, &input, &error]() {
+            try {
+                m_simulation_loop(client, input);
+            } catch (...) {
+                error = std::current_exception();
+                input.over.store(true);
+            }
+        } };
+
+        // The simulation thread must be joined however the loop is left
+        try {
+            while (true) {
+                {
+                    DICK_PROFILE_SCOPE("poll");
+                    m_process_events(input);
+                    if (input.is_over() || m_kill_flag) break;
+                    process_pending_loads(m_load_budget);
+
+                    if (m_latest_snapshot.load() & FRESH_SNAPSHOT) {
+                        read_slot = m_latest_snapshot.exchange(read_slot) & ~FRESH_SNAPSHOT;
+                        published = true;
+                    }
+
+                    if (published) {
+                        DICK_PROFILE_SCOPE("draw");
+                        const double elapsed = al_get_time() - m_publish_times[read_slot];
+                        client.draw_snapshot(read_slot, std::min(elapsed / spf, 1.0));
+                        ++m_loop_stats.frames;
+                    }
+                }
+                al_rest(0.001);
+            }
+        } catch (...) {
+            m_stop_simulation.store(true);
+            simulation.join();
+            throw;
+        }
+
+        m_stop_simulation.store(true);
+        simulation.join();
+        m_loop_stats.run_time += al_get_time() - start_time;
+
+        if (error) {
+            std::rethrow_exception(error);
         }
     }
 };
 
 Platform::Platform(const DimScreen &screen_size) : m_impl { new PlatformImpl { screen_size } } {}
+Platform::Platform(HeadlessMode, const Headless &headless) : m_impl { new PlatformImpl { headless } } {}
 Platform::~Platform() { delete m_impl; }
 void Platform::real_time_loop(PlatformClient &client) { m_impl->real_time_loop(client); }
+void Platform::set_tick_rate(double ticks_per_second) { m_impl->set_tick_rate(ticks_per_second); }
+void Platform::set_max_catch_up_ticks(int ticks) { m_impl->set_max_catch_up_ticks(ticks); }
+void Platform::set_catch_up_policy(CatchUp::Enum policy) { m_impl->set_catch_up_policy(policy); }
+void Platform::set_variable_step(bool variable_step) { m_impl->set_variable_step(variable_step); }
+LoopStats Platform::loop_stats() const { return m_impl->loop_stats(); }
+void Platform::dump_loop_stats(std::ostream &out) const { m_impl->dump_loop_stats(out); }
+void Platform::set_event_driven(bool event_driven, bool render_when_dirty)
+{
+    m_impl->set_event_driven(event_driven, render_when_dirty);
+}
+void Platform::set_cursor_coalescing(bool coalescing) { m_impl->set_cursor_coalescing(coalescing); }
+Jobs &Platform::jobs() { return m_impl->jobs(); }
+void Platform::pipelined_loop(PipelinedClient &client) { m_impl->pipelined_loop(client); }
+void Platform::record_input(const std::string &path) { m_impl->record_input(path); }
+void Platform::replay_input(const std::string &path) { m_impl->replay_input(path); }
 
 }
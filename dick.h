@@ -4,8 +4,10 @@
 #ifndef DICK_H
 #define DICK_H
 
+#include <iosfwd>
 #include <vector>
 #include <memory>
+#include <cstdint>
 #include <limits>
 #include <stdexcept>
 #include <functional>
@@ -64,10 +66,170 @@ struct Color {
 #   define LOG_TRACE(LOG_FORMAT, ...) LOG_MESSAGE("TRACE", LOG_FORMAT, ##__VA_ARGS__)
 #endif
 
+// Profiling
+// =========
+
+// Scoped timing zones, recorded while the profiler is enabled into per-thread
+// ring buffers holding the most recent 64K samples. The platform's loop
+// records its phases: the polling loops' iterations ("poll"), or the frames
+// of the event driven and headless loops ("frame"), and within them the
+// non-empty "events" and "loads" along with the "tick" and "draw" calls. The
+// clients may add their own zones with DICK_PROFILE_SCOPE.
+// The names must be string literals or otherwise outlive the dump. A zone
+// costs a flag check while the profiler is disabled, and the macro zones are
+// compiled out altogether if DICK_PROFILE is defined to 0.
+class ProfileZone {
+    const char *m_name;
+    std::uint64_t m_start;
+
+public:
+    explicit ProfileZone(const char *name);
+    ~ProfileZone();
+    ProfileZone(const ProfileZone&) = delete;
+    ProfileZone &operator=(const ProfileZone&) = delete;
+};
+
+void enable_profiler(bool enabled);
+
+// Names the calling thread in the dumped trace
+void name_profiled_thread(const std::string &name);
+
+// Writes the recorded samples in the Chrome trace event JSON format, which
+// may be opened with Perfetto or chrome://tracing. It's safe to dump while
+// the other threads keep recording.
+void dump_profile_trace(std::ostream &out);
+
+#ifndef DICK_PROFILE
+#   define DICK_PROFILE 1
+#endif
+
+#if DICK_PROFILE
+#   define DICK_PROFILE_CONCAT_IMPL(A, B) A##B
+#   define DICK_PROFILE_CONCAT(A, B) DICK_PROFILE_CONCAT_IMPL(A, B)
+#   define DICK_PROFILE_SCOPE(NAME) \
+        ::dick::ProfileZone DICK_PROFILE_CONCAT(dick_profile_zone_, __LINE__) { NAME }
+#else
+#   define DICK_PROFILE_SCOPE(NAME)
+#endif
+
 // Resources management
 // ====================
 
 class ResourcesImpl;
+class ResourceFutureImpl;
+class TiledImageImpl;
+class AudioStreamImpl;
+
+// Compact identifiers of the resource keys. Interning a key is a hash map
+// lookup, but afterwards the identifier may be used for the lookups in all
+// the Resources instances, which boil down to indexing an array per instance.
+// The identifiers remain valid for the life time of the program.
+struct ImageId {
+    std::uint32_t index;
+};
+
+struct FontId {
+    std::uint32_t index;
+};
+
+ImageId intern_image(const std::string &path);
+FontId intern_font(const std::string &path, int size);
+
+// A resource pointer along with the generation of the resource it points to.
+// Every time a resource is (re)loaded it gets a new generation, therefore a
+// pointer that has been invalidated, e.g. by the eviction of the resource,
+// can be detected by the Resources::is_valid() call, which doesn't count as
+// a use of the resource.
+template <class Id>
+struct ResourceHandle {
+    Id id;
+    std::uint64_t generation;
+    void *pointer;
+};
+
+typedef ResourceHandle<ImageId> ImageHandle;
+typedef ResourceHandle<FontId> FontHandle;
+
+// A handle to a resource that is being loaded in the background. The state
+// may be polled with is_ready() or waited on with get(), which blocks until
+// the resource is available and throws an Error if the loading has failed.
+//
+// Note that the final stage of loading (e.g. the upload of an image to the
+// video memory) is always performed on the main thread, therefore get() may
+// only be called from there.
+struct ResourceFuture {
+    std::shared_ptr<ResourceFutureImpl> m_impl;
+    bool is_ready() const;
+    void *get();
+};
+
+// A very large image split into square tiles, which are loaded on demand and
+// kept in a cache of a bounded size, so that the memory use depends on the
+// viewed area rather than the size of the image. The tiles intersecting the
+// requested rectangle (in the image's pixels) are cut in the background and
+// uploaded on the main thread by process_pending_loads(). The tiles that are
+// not yet available are skipped when drawing.
+//
+// The size is zero until the image is available, which is immediately for the
+// images streamed from a mounted archive. The others have to be decoded whole
+// first, which doesn't affect the video memory use, but takes time.
+struct TiledImage {
+    std::shared_ptr<TiledImageImpl> m_impl;
+    int width() const;
+    int height() const;
+    int tile_size() const;
+    void request(double x, double y, double width, double height);
+    void *get_tile(int column, int row) const;
+
+    // Requests the source region and draws the available part of it at the
+    // given destination.
+    void draw_region(double sx, double sy, double sw, double sh, double dx, double dy);
+};
+
+// A piece of audio, e.g. music, decoded gradually while playing, so that only
+// the few small buffers are kept in memory. The stream is attached to the
+// default mixer and closed along with the last copy of this object.
+struct AudioStream {
+    std::shared_ptr<AudioStreamImpl> m_impl;
+    void play(bool loop = true);
+    void pause();
+    void stop();
+    bool is_playing() const;
+    void set_gain(double gain);
+    void *get() const;
+};
+
+// A list of the resources to be loaded up front, e.g. behind a loading screen.
+// The fonts are given as the paths along with the sizes.
+struct ResourceManifest {
+    std::vector<std::string> images;
+    std::vector<std::pair<std::string, int>> fonts;
+};
+
+// Bit distinct flags of the derived image variants
+struct ImageFlip {
+    enum Enum {
+        HORIZONTAL = 0x1,
+        VERTICAL = 0x2
+    };
+};
+
+// The counters of a single Resources instance. The hits count the requests
+// served with this instance's own resources, including the requests made by
+// the descendant instances. The parent hits and misses only count the
+// requests made to this instance, served up-stream or not served at all. The
+// loading time includes both the background and the main thread stages.
+struct ResourceStats {
+    std::uint64_t hits;
+    std::uint64_t parent_hits;
+    std::uint64_t misses;
+    std::uint64_t loads;
+    std::uint64_t decode_us;
+    std::size_t bytes_resident;
+};
+
+// Called on the main thread each time a preloaded resource is done loading
+typedef std::function<void(int loaded, int total)> ProgressCallback;
 
 struct Resources {
     // This API is designed to enable lazy loading of assets. The Resources
@@ -84,6 +246,11 @@ struct Resources {
     //
     // Note that no caching is performed in the parent instances. It may
     // be only done in the instance which handles the resource request.
+    // However, each instance remembers where the requested resources have
+    // been found up-stream (or that they haven't been), so that the deep
+    // trees don't have to be searched on every request. These memos are
+    // invalidated whenever an instance with children loads or drops any
+    // resource.
     //
     // The returned values are type-erased pointer to a framework speciffic
     // resource pointers.
@@ -93,8 +260,147 @@ struct Resources {
     ~Resources();
     void *get_image(const std::string &path);
     void *get_font(const std::string &path, int size);
+    void *get_image(ImageId id);
+    void *get_font(FontId id);
+
+    // The short sounds are decoded whole and stored like the other resources.
+    // The long ones, e.g. music, should rather be streamed; each stream is
+    // independent and buffers the given number of samples a few times.
+    // Neither is available without the platform's audio initialization.
+    void *get_sample(const std::string &path);
+    AudioStream open_stream(const std::string &path, int buffer_count = 4, int buffer_samples = 2048);
+
+    // The asynchronous counterparts of the above getters. The files are
+    // decoded by a pool of worker threads and the results are finalized on
+    // the main thread, either by the process_pending_loads() calls or upon
+    // waiting on the returned handle. Requesting a resource that is already
+    // available yields a handle that is ready immediately.
+    ResourceFuture get_image_async(const std::string &path);
+    ResourceFuture get_font_async(const std::string &path, int size);
+
+    // Returns a copy of the image scaled, tinted and flipped according to
+    // the ImageFlip flags, so that it may be drawn without the per frame
+    // transformation. The variant is computed on the CPU upon the first
+    // request, stored in this instance and recomputed only if the original
+    // gets reloaded. The variants are not subject to the memory budget.
+    void *get_image_variant(
+            const std::string &path,
+            double scale,
+            Color tint = Color { 1.0, 1.0, 1.0 },
+            int flags = 0);
+
+    // Requests all the resources from the manifest asynchronously so that
+    // they are decoded in parallel and stored in this instance. The returned
+    // handle becomes ready once all of them are done; waiting on it throws if
+    // any of them has failed. The progress callback is run as the individual
+    // resources get finalized, some of them possibly within this very call.
+    ResourceFuture preload(const ResourceManifest &manifest, ProgressCallback progress = {});
+
+    // Enables packing of the images subsequently loaded by this instance
+    // into shared atlas pages. Only the images that do not exceed the given
+    // size limit in either dimension are packed. The returned pointers then
+    // refer to the sub-images of the atlas pages so that the drawing of many
+    // of them may be batched by the underlying library. The pages live as
+    // long as this instance.
+    void enable_atlas(int page_size = 1024, int max_image_size = 128);
+
+    // Makes this instance share the images loaded from now on with all the
+    // other instances that enabled the sharing. The images are identified by
+    // the contents of their files regardless of the paths, so that the same
+    // file requested by unrelated instances is decoded and stored only once.
+    // The shared images are not packed into the atlas.
+    void enable_image_sharing();
+
+    // Limits the approximate memory footprint of the resources stored in
+    // this instance. Once exceeded, the least recently used resources are
+    // evicted and reloaded upon the next request. The images packed into an
+    // atlas are never evicted, hence neither they nor the atlas pages count
+    // toward the budget. Zero means no limit, which is the default.
+    //
+    // Note that with a budget set the raw pointers obtained from this
+    // instance may be invalidated by any later request, therefore they should
+    // either be obtained anew each time or tracked with the handles below.
+    void set_memory_budget(std::size_t bytes);
+
+    // Maps the archive built with pack_archive() into memory so that the
+    // resources it contains are created directly from the mapped data rather
+    // than loaded and decoded from the individual files. The archive is also
+    // used by the descendant instances and stays mapped as long as this
+    // instance lives.
+    void mount_archive(const std::string &path);
+
+    // Watches the files of the images stored in this instance and reloads
+    // the modified ones without restarting the program. The files are
+    // decoded in the background and swapped on the main thread by
+    // process_pending_loads(). An image of unchanged size is updated in
+    // place, so the pointers and handles remain valid; otherwise the handles
+    // are invalidated. Only supported on Linux and not in the concurrent
+    // mode.
+    void enable_watch();
+
+    // Opens a large image for the tiled streaming (see TiledImage). The image
+    // should be packed into an archive mounted in this or an up-stream
+    // instance, which enables the random access to the tiles.
+    TiledImage open_tiled_image(const std::string &path, int tile_size = 512, int max_tiles = 64);
+
+    // Makes the getters of this instance and its up-stream instances safe to
+    // call from any thread. The pointers to the stored resources are then
+    // found without locking, and the concurrent requests for a missing
+    // resource load it only once. The images loaded outside of the main
+    // thread start as memory bitmaps and are converted in place, keeping the
+    // pointers, by process_pending_loads(). The fonts requested outside of
+    // the main thread are only read there and created by
+    // process_pending_loads(), which the requests wait for. The descendants
+    // created later
+    // inherit the mode. The rest of the API is thread safe as well, but
+    // remains meant for the main thread.
+    //
+    // Must be called from the main thread before the other threads start
+    // using the instance, with no memory budget set nor watching enabled,
+    // and with the archives already mounted.
+    void enable_concurrency();
+
+    // Instrumentation. The dump lists the counters along with every resource
+    // loaded so far by this instance and then recurses into the descendants.
+    ResourceStats stats() const;
+    void dump_stats(std::ostream &out) const;
+
+    // Returns a bitmap font with the glyphs of the given character range
+    // pre-rendered from the TrueType font, so that drawing text doesn't
+    // involve rasterizing glyphs upon their first use. If a glyph cache
+    // directory is set (here or up-stream), the rendered glyphs are stored
+    // there, keyed with the font file's hash, the size and the range, and
+    // later runs load them from there instead of the TrueType file. Note that
+    // the kerning is lost in the process.
+    void set_glyph_cache_dir(const std::string &path);
+    void *get_font_baked(const std::string &path, int size, int first_char = 32, int last_char = 126);
+
+    ImageHandle get_image_handle(ImageId id);
+    FontHandle get_font_handle(FontId id);
+    bool is_valid(const ImageHandle &handle);
+    bool is_valid(const FontHandle &handle);
 };
 
+// Finalizes the resources decoded in the background, spending no more than
+// the given time budget (in seconds) unless a single resource takes longer.
+// The platform's real time loop calls this once per frame; a client running
+// its own loop must call it from the main thread by itself.
+void process_pending_loads(double time_budget);
+
+// Builds an archive of the given images, stored pre-decoded, and fonts, stored
+// as they are, to be used with Resources::mount_archive(). The entries are
+// named with the paths as given here, so they should be relative to the
+// mounting instance's prefix. This is meant to be run at build time (see the
+// dickpack tool) and requires the Allegro system and image add-on to be
+// initialized.
+void pack_archive(const std::string &archive_path, const std::vector<std::string> &paths);
+
+// Registers the QOI image format with the Allegro image add-on, so that the
+// ".qoi" files are loaded and saved like any other image. The platform does
+// it upon initialization; the programs that initialize the add-on by
+// themselves, like the tools, must call it explicitly.
+void register_qoi_format();
+
 double image_width(void *image);
 double image_height(void *image);
 DimScreen image_size(void *image);
@@ -175,6 +481,17 @@ enum class Button {
     MAX
 };
 
+// Bit distinct flags of the input event kinds a client may be interested in
+struct InputInterest {
+    enum Enum {
+        NONE = 0,
+        KEYS = 1,
+        BUTTONS = 2,
+        CURSOR = 4,
+        ALL = KEYS | BUTTONS | CURSOR
+    };
+};
+
 class InputState {
     std::vector<bool> m_keys;
     std::vector<bool> m_buttons;
@@ -209,6 +526,44 @@ struct PlatformClient {
     virtual void on_cursor(DimScreen position) = 0;
     virtual void tick(double dt) = 0;
     virtual void draw(double weight) = 0;
+
+    // Consulted by the platform rendering only when dirty (see Platform) to
+    // tell whether the ticks have changed anything worth redrawing.
+    virtual bool needs_redraw() const { return true; }
+
+    // The kinds of input events to be handed to the client (see
+    // InputInterest); the others are neither translated nor dispatched.
+    // Consulted once per frame.
+    virtual int input_interest() const { return InputInterest::ALL; }
+
+    // Called instead of on_cursor() when the platform coalesces the cursor
+    // motion (see Platform), at most once per frame and before any button
+    // event, with the latest position and the motion accumulated since the
+    // previous call.
+    virtual void on_cursor_motion(DimScreen position, DimScreen) { on_cursor(position); }
+};
+
+// A client whose simulation runs on a thread of its own, apart from the
+// rendering, when run by the platform's pipelined loop. The input handlers,
+// is_over(), input_interest() and tick() are called on the simulation
+// thread, and each tick is followed by publish() of the state needed for
+// drawing into one of three snapshot slots owned by the client. The main
+// thread only calls draw_snapshot() with the most recently published slot,
+// which is never the one being published at the same time. The weight is the
+// fraction of the next tick that has already elapsed, so a snapshot should
+// carry both the current and the previous state for the interpolation.
+//
+// Since the resources may only be loaded on the main thread, the simulation
+// should refer to the resources acquired up front (or use the concurrent
+// Resources mode).
+struct PipelinedClient : public PlatformClient {
+    static const int SNAPSHOT_SLOTS = 3;
+
+    virtual void publish(int slot) = 0;
+    virtual void draw_snapshot(int slot, double weight) = 0;
+
+    // Not used in the pipelined loop
+    void draw(double) override {}
 };
 
 // State node is an object that can be plugged in directly to the platform
@@ -273,6 +628,9 @@ struct StateMachine : public PlatformClient {
     void on_cursor(DimScreen position) override;
     void tick(double dt) override;
     void draw(double weight) override;
+    bool needs_redraw() const override;
+    int input_interest() const override;
+    void on_cursor_motion(DimScreen position, DimScreen delta) override;
 };
 
 // OOP GUI
@@ -505,19 +863,151 @@ struct GUI {
             const DimScreen& offset = { 0, 0 });
 };
 
+// Job system
+// ==========
+
+class JobsImpl;
+struct JobCounterImpl;
+
+// Counts the unfinished jobs started with it. The first exception thrown by
+// the jobs is kept and rethrown by Jobs::wait().
+class JobCounter {
+    friend class JobsImpl;
+    std::shared_ptr<JobCounterImpl> m_impl;
+
+public:
+    JobCounter();
+    bool done() const;
+};
+
+// A pool of worker threads with a work-stealing deque each. The jobs started
+// by a worker go to its own deque and the others' to the workers' deques in
+// turns, while the idle workers steal from the busy ones. A thread waiting
+// for a counter runs the pending jobs meanwhile, therefore the jobs may start
+// and wait for other jobs, and the calling thread takes part in the work.
+// All the calls are thread safe.
+struct Jobs {
+    JobsImpl *m_impl;
+
+    // Zero threads stand for one per core but the calling one's
+    explicit Jobs(unsigned threads = 0);
+    ~Jobs();
+    Jobs(const Jobs&) = delete;
+    Jobs &operator=(const Jobs&) = delete;
+
+    unsigned thread_count() const;
+
+    void run(std::function<void()> job, JobCounter &counter);
+
+    // Starts the job once the dependency is done
+    void run_after(const JobCounter &dependency, std::function<void()> job, JobCounter &counter);
+
+    void wait(const JobCounter &counter);
+
+    // Calls the body for the consecutive subranges of [begin, end), no longer
+    // than the grain, in parallel and waits for all of them. A zero grain
+    // splits the range into a few chunks per thread.
+    void parallel_for(
+            std::size_t begin, std::size_t end,
+            const std::function<void(std::size_t, std::size_t)> &body,
+            std::size_t grain = 0);
+};
+
 // Core object
 // ===========
 
 class PlatformImpl;
 
+// The policies for the simulation time the loop couldn't catch up with
+// within the limit of ticks per frame. The time is either dropped, so that
+// the simulation stays in pace with the real time, or carried over to the
+// next frames, slowing the simulation down temporarily (up to a second of
+// the backlog is kept).
+struct CatchUp {
+    enum Enum {
+        DROP,
+        SLOWDOWN
+    };
+};
+
+// The counters of the platform's loop; the dropped time is the simulation
+// time lost due to the catch up limits and the run time is the wall clock
+// time spent in the loops.
+struct LoopStats {
+    std::uint64_t frames;
+    std::uint64_t ticks;
+    double dropped_time;
+    double run_time;
+};
+
+// The configuration of a platform with no window, input nor audio devices,
+// meant for benchmarks and soak tests. The clients are ticked on a simulated
+// clock as fast as possible, until they're over or for the given number of
+// ticks if non-zero, and drawn into an offscreen memory bitmap every given
+// number of ticks if non-zero. The loop stats are dumped to the standard log
+// stream upon the loop's exit.
+struct Headless {
+    DimScreen screen_size;
+    std::uint64_t ticks;
+    int draw_interval;
+};
+
+// Selects the headless platform constructor, which can't be told from the
+// regular one by the braced configuration alone.
+struct HeadlessMode {};
+
 struct Platform {
     // It's harder to implement this any simpler way. Provide your client
     // state to the real_time_loop and handle events.
 
     PlatformImpl *m_impl;
     Platform(const DimScreen &screen_size);
+    Platform(HeadlessMode, const Headless &headless);
     ~Platform();
     void real_time_loop(PlatformClient &client);
+
+    // The loop timing. By default the clients are ticked with a fixed step
+    // 50 times per second, with up to 3 ticks per frame to catch up and the
+    // excess time dropped. In the variable step mode the clients are ticked
+    // once per frame with the frame's duration, limited the same way.
+    void set_tick_rate(double ticks_per_second);
+    void set_max_catch_up_ticks(int ticks);
+    void set_catch_up_policy(CatchUp::Enum policy);
+    void set_variable_step(bool variable_step);
+    LoopStats loop_stats() const;
+    void dump_loop_stats(std::ostream &out) const;
+
+    // Makes the loop block waiting for the input and for a timer ticking at
+    // the tick rate instead of polling, so that an idle program doesn't keep
+    // the processor busy. When rendering only when dirty, the frame is drawn
+    // only upon input or if the client needs_redraw() after the ticks.
+    void set_event_driven(bool event_driven, bool render_when_dirty = false);
+
+    // Collapses the cursor motion events of a frame into a single
+    // on_cursor_motion() call, sparing the clients the per event handling of
+    // the high rate mice.
+    void set_cursor_coalescing(bool coalescing);
+
+    // Runs the client's simulation at the tick rate on a separate thread,
+    // limited by the catch up settings like the real time loop, while the
+    // calling thread handles the input and draws the published snapshots.
+    // The exceptions thrown on the simulation thread are rethrown here.
+    void pipelined_loop(PipelinedClient &client);
+
+    // The job system shared by the clients, e.g. to update the independent
+    // objects in parallel within a tick.
+    Jobs &jobs();
+
+    // Input recording and replay, applying to the next loop run. While
+    // recording, every input event handed to the client is logged along with
+    // the index of the tick it precedes, and the loop's end is logged with
+    // the number of ticks. A replayed log substitutes the live input: the
+    // events are delivered right before their ticks, always with the fixed
+    // step, and the loop ends after the recorded number of ticks. Combined
+    // with the headless mode this reruns the session as fast as possible.
+    // The pipelined loop supports neither.
+    void record_input(const std::string &path);
+    void replay_input(const std::string &path);
 };
 
 }
@@ -0,0 +1,32 @@
+// Copyright (C) 2015 Krzysztof Stachowiak
+// For the license (GPL2) details see the LICENSE file
+
+#include <iostream>
+
+#include <allegro5/allegro.h>
+#include <allegro5/allegro_image.h>
+
+#include "dick.h"
+
+int main(int argc, char *argv[])
+{
+    if (argc < 3) {
+        std::cerr << "Usage: " << argv[0] << " ARCHIVE FILE..." << std::endl;
+        return 1;
+    }
+
+    if (!al_init() || !al_init_image_addon()) {
+        std::cerr << "Failed initializing allegro" << std::endl;
+        return 1;
+    }
+    dick::register_qoi_format();
+
+    try {
+        dick::pack_archive(argv[1], std::vector<std::string>(argv + 2, argv + argc));
+    } catch (const dick::Error &e) {
+        std::cerr << e.what() << std::endl;
+        return 1;
+    }
+
+    return 0;
+}
@@ -0,0 +1,53 @@
+// Copyright (C) 2015 Krzysztof Stachowiak
+// For the license (GPL2) details see the LICENSE file
+
+#include <iostream>
+
+#include <allegro5/allegro.h>
+#include <allegro5/allegro_image.h>
+
+#include "dick.h"
+
+// Converts the given images to the QOI format, writing each next to its
+// source with the extension replaced.
+int main(int argc, char *argv[])
+{
+    if (argc < 2) {
+        std::cerr << "Usage: " << argv[0] << " FILE..." << std::endl;
+        return 1;
+    }
+
+    if (!al_init() || !al_init_image_addon()) {
+        std::cerr << "Failed initializing allegro" << std::endl;
+        return 1;
+    }
+    dick::register_qoi_format();
+
+    // The pixels are written as they are loaded, hence no premultiplication
+    al_set_new_bitmap_flags(ALLEGRO_MEMORY_BITMAP);
+
+    int result = 0;
+    for (int i = 1; i < argc; ++i) {
+        const std::string input = argv[i];
+        const std::size_t dot = input.rfind('.');
+        const std::size_t slash = input.rfind('/');
+        const bool has_extension = dot != std::string::npos && (slash == std::string::npos || dot > slash);
+        const std::string output = (has_extension ? input.substr(0, dot) : input) + ".qoi";
+
+        ALLEGRO_BITMAP *bitmap = al_load_bitmap_flags(input.c_str(), ALLEGRO_NO_PREMULTIPLIED_ALPHA);
+        if (!bitmap) {
+            std::cerr << "Failed loading image " << input << std::endl;
+            result = 1;
+            continue;
+        }
+
+        if (!al_save_bitmap(output.c_str(), bitmap)) {
+            std::cerr << "Failed saving image " << output << std::endl;
+            result = 1;
+        }
+
+        al_destroy_bitmap(bitmap);
+    }
+
+    return result;
+}